@@ -0,0 +1,107 @@
+--[[
+	fann.ffi: runs networks through the C functions exported by the fann
+	module, using LuaJIT's FFI when it is there, so that scoring loops stay
+	in compiled traces and allocate nothing per call. On other Lua
+	implementations the runners fall back to ann:run().
+
+	local runner = require("fann.ffi").runner(ann)
+	runner.input[0], runner.input[1] = -1, 1
+	local out = runner:run()	-- out[0] is the first output
+
+	The inputs and outputs of a runner are float arrays indexed from 0 (Lua
+	tables without the FFI). A runner keeps its network alive; running it
+	after the network is closed with ann:__gc() raises an error.
+]]
+
+local M = {}
+
+local ok, ffi = pcall(require, "ffi")
+M.ffi = ok
+
+if ok then
+	ffi.cdef[[
+		struct luafann_abi
+		{
+			unsigned int version;
+			unsigned int (*num_input)(void *handle);
+			unsigned int (*num_output)(void *handle);
+			int (*run)(void *handle, const float *input, float *output);
+			int (*run_batch)(void *handle, unsigned int rows, const float *input, float *output);
+		};
+	]]
+end
+
+-- Returns an array of n floats, indexed from 0
+function M.buffer(n)
+	if ok then
+		return ffi.new("float[?]", n)
+	end
+	local t = {}
+	for i = 0, n - 1 do t[i] = 0 end
+	return t
+end
+
+local ffi_runner = {}
+ffi_runner.__index = ffi_runner
+
+-- Evaluates the network on self.input into self.output, and returns the latter
+function ffi_runner:run()
+	if self.abi.run(self.handle, self.input, self.output) ~= 0 then
+		error("the neural net is closed", 2)
+	end
+	return self.output
+end
+
+-- Evaluates the network on rows of inputs back to back in the float array
+-- input, putting the rows of outputs in the float array output
+function ffi_runner:run_batch(rows, input, output)
+	if self.abi.run_batch(self.handle, rows, input, output) ~= 0 then
+		error("the neural net is closed", 2)
+	end
+	return output
+end
+
+local lua_runner = {}
+lua_runner.__index = lua_runner
+
+local unpack = unpack or table.unpack
+
+local function run_row(ann, input, output, nin, nout, ifirst, ofirst)
+	local out = {ann:run(unpack(input, ifirst, ifirst + nin - 1))}
+	for i = 1, nout do output[ofirst + i - 1] = out[i] end
+end
+
+function lua_runner:run()
+	self.ann:handle()	-- raises an error if the network is closed
+	run_row(self.ann, self.input, self.output, self.num_input, self.num_output, 0, 0)
+	return self.output
+end
+
+function lua_runner:run_batch(rows, input, output)
+	self.ann:handle()
+	for r = 0, rows - 1 do
+		run_row(self.ann, input, output, self.num_input, self.num_output, r*self.num_input, r*self.num_output)
+	end
+	return output
+end
+
+-- Returns a runner for the network ann, with preallocated input and output
+-- arrays
+function M.runner(ann)
+	local handle, abi, num_input, num_output = ann:handle()
+	local runner
+	if ok then
+		abi = ffi.cast("struct luafann_abi *", abi)
+		assert(abi.version == 1, "unsupported fann ABI version")
+		runner = setmetatable({ann = ann, handle = handle, abi = abi}, ffi_runner)
+	else
+		runner = setmetatable({ann = ann}, lua_runner)
+	end
+	runner.num_input = num_input
+	runner.num_output = num_output
+	runner.input = M.buffer(runner.num_input)
+	runner.output = M.buffer(runner.num_output)
+	return runner
+end
+
+return M
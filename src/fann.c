@@ -27,11 +27,37 @@
  *# In the examples below, the variable {{ann}} refers to a neural network
  *# object instance created by {{fann.create_standard()}} or {{fann.create_from_file()}},
  *# and the variable {{train}} refers to a training set object instance created by
- *# {{fann.read_train_from_file()}}
+ *# {{fann.read_train_from_file()}}\n
+ *# \n
+ *# Luafann can also be built against FANN's float, double or fixed point
+ *# library, as the modules {{fann.float}}, {{fann.double}} and {{fann.fixed}},
+ *# which can be loaded alongside each other. The fixed point module runs
+ *# networks saved in fixed point format by {{ann:save_to_fixed()}} and has
+ *# no training functions. It takes and returns the same real values as the
+ *# other modules, converting them with each network's fixed point
+ *# multiplier; only training data keeps FANN's fixed point format.
  *-
  */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
 #include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 #include "fann.h"
 
@@ -53,6 +79,7 @@ LUALIB_API void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 }
 
 #define lua_isinteger(L,l) lua_isnumber(L,l)
+#define lua_rawlen(L,i) lua_objlen(L,i)
 #if !defined luaL_newlibtable
 #define luaL_newlibtable(L,l) lua_createtable(L,0,sizeof(l)/sizeof((l)[0]))
 #endif
@@ -81,10 +108,321 @@ LUALIB_API void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 //#define lua_register(L,n,f) (lua_pushcfunction(L, (f)), lua_setglobal(L, (n)))
 #endif
 
+#if LUA_VERSION_NUM > 501
+#define ann_resume(co, from, n) lua_resume(co, from, n)
+#else
+#define ann_resume(co, from, n) lua_resume(co, n)
+#endif
+
+/*
+ * The module is built against one of FANN's fann_type variants: the float,
+ * double or fixed point library when FLOATFANN, DOUBLEFANN or FIXEDFANN is
+ * defined, each loaded as its own module (fann.float, fann.double and
+ * fann.fixed), or else the default libfann as plain fann. The metatable
+ * names carry the variant so that several can be loaded side by side.
+ */
+#if defined(FIXEDFANN)
+#include <fixedfann.h>
+#define ANN_VARIANT ".fixed"
+#elif defined(DOUBLEFANN)
+#include <doublefann.h>
+#define ANN_VARIANT ".double"
+#elif defined(FLOATFANN)
+#include <floatfann.h>
+#define ANN_VARIANT ".float"
+#else
 #include <fann.h>
+#define ANN_VARIANT ""
+#endif
+
+#define FANN_METATABLE "spil.fann" ANN_VARIANT
+#define FANN_TRAIN_METATABLE "spil.fanntrain" ANN_VARIANT
+#define FANN_QUEUE_METATABLE "spil.fannqueue" ANN_VARIANT
+#define FANN_TRAIN_JOB_METATABLE "spil.fanntrainjob" ANN_VARIANT
+#define FANN_MODEL_METATABLE "spil.fannmodel" ANN_VARIANT
+#define FANN_SHARED_METATABLE "spil.fannshared" ANN_VARIANT
+#define FANN_GENERATOR_METATABLE "spil.fanngenerator" ANN_VARIANT
+#define FANN_STREAM_METATABLE "spil.fannstream" ANN_VARIANT
+#define FANN_PIPELINE_METATABLE "spil.fannpipeline" ANN_VARIANT
+#define FANN_SHM_METATABLE "spil.fannshm" ANN_VARIANT
+#define FANN_QUEUE_PARKED "spil.fannqueueparked" ANN_VARIANT
+
+#define ANN_MAX_THREADS 64
+
+/*
+ * Lua numbers become fann_type values, and back, through these. The fixed
+ * point build scales them by m, the multiplier of the network they are for
+ * (see ann_multiplier()), so that every variant takes and returns the same
+ * real values.
+ */
+#ifdef FIXEDFANN
+#define ann_multiplier(ann) fann_get_multiplier(ann)
+#define ann_fromfann(m, v) ((lua_Number)(v) / (m))
+
+static fann_type ann_tofann(unsigned int m, lua_Number n)
+{
+	n = floor(n*m + 0.5);
+	if(!(n > INT_MIN))
+		return INT_MIN;
+	return n < INT_MAX ? (fann_type)n : INT_MAX;
+}
+#else
+#define ann_multiplier(ann) 1
+#define ann_fromfann(m, v) ((void)(m), (lua_Number)(v))
+#define ann_tofann(m, n) ((void)(m), (fann_type)(n))
+#endif
+
+/*
+ * Reads a table of exactly n numbers at stack index idx into dst, as values
+ * of multiplier m. what names the vector in error messages.
+ */
+static void ann_checkvector(lua_State *L, int idx, const char *what, unsigned int n, fann_type *dst,
+							unsigned int m)
+{
+	unsigned int i;
+
+	if(idx < 0)
+		idx = lua_gettop(L) + idx + 1;
+
+	if(!lua_istable(L, idx))
+		luaL_error(L, "%s must be a table", what);
+
+	if(lua_rawlen(L, idx) != n)
+		luaL_error(L, "wrong number of %s: expected %d, got %d", what, n, (int)lua_rawlen(L, idx));
+
+	for(i = 0; i < n; i++)
+	{
+		lua_rawgeti(L, idx, i + 1);
+		if(!lua_isnumber(L, -1))
+			luaL_error(L, "%s[%d] must be a number", what, i + 1);
+		dst[i] = ann_tofann(m, lua_tonumber(L, -1));
+		lua_pop(L, 1);
+	}
+}
+
+/*
+ * A trace of the inputs a network is run on, recorded by ann:record(). It
+ * starts with the magic "LFTR" and the format version, the number of inputs
+ * and the size of the values (4 for float, 8 for double) as native 32 bit
+ * integers. Then each row of inputs evaluated follows as the nanoseconds
+ * since recording started (a native 64 bit integer), the number of the call
+ * it was passed to (32 bit; the rows of a batch call share it) and the
+ * inputs. The network's userdata points to the trace while recording.
+ */
+#define ANN_TRACE_MAGIC "LFTR"
+#define ANN_TRACE_VERSION 1
+#define ANN_TRACE_HEADER 16
+#define ANN_TRACE_ROW 12
+
+struct ann_trace
+{
+	FILE *f;
+	struct timespec start;
+	uint32_t calls;
+	uint64_t rows;
+	unsigned int num_input;
+	unsigned int multiplier;	/* of the network's fixed point values */
+	size_t value_size;
+};
+
+/*
+ * The userdata of a neural net. The handle comes first, so that it can be
+ * used as a struct fann ** like the userdata of the other types. The trace
+ * is kept here rather than in FANN's user data, which fann_copy() copies to
+ * the clones run by other threads. Double and fixed point builds convert
+ * the inputs given to the C functions into input, allocated by ann:handle().
+ */
+struct ann_net
+{
+	struct fann *ann;
+	struct ann_trace *trace;
+	fann_type *input;
+};
+
+/*
+ * Returns the nanoseconds since start on the monotonic clock
+ */
+static uint64_t ann_trace_clock(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - start->tv_sec)*1000000000 + now.tv_nsec - start->tv_nsec;
+}
+
+/*
+ * Returns the trace ann is being recorded to, or NULL
+ */
+static struct ann_trace *ann_trace_of(struct fann **ann)
+{
+	return ((struct ann_net *)ann)->trace;
+}
+
+/*
+ * Appends a row of inputs to trace t, as the first row of a new call if
+ * new_call is set
+ */
+static void ann_trace_row(struct ann_trace *t, const fann_type *input, int new_call)
+{
+	uint64_t time;
+	unsigned int i;
+	double d;
+	float f;
+
+	if(new_call)
+		t->calls++;
+	time = ann_trace_clock(&t->start);
+	fwrite(&time, sizeof time, 1, t->f);
+	fwrite(&t->calls, sizeof t->calls, 1, t->f);
+
+	for(i = 0; i < t->num_input; i++)
+	{
+		if(t->value_size == sizeof d)
+		{
+			d = ann_fromfann(t->multiplier, input[i]);
+			fwrite(&d, sizeof d, 1, t->f);
+		}
+		else
+		{
+			f = ann_fromfann(t->multiplier, input[i]);
+			fwrite(&f, sizeof f, 1, t->f);
+		}
+	}
+	t->rows++;
+}
+
+/*
+ * Stops recording ann. Returns nonzero if writing the trace failed.
+ */
+static int ann_trace_close(struct fann **ann)
+{
+	struct ann_trace *t = ann_trace_of(ann);
+	int failed;
+
+	failed = ferror(t->f) != 0;
+	if(fclose(t->f))
+		failed = 1;
+	free(t);
+	((struct ann_net *)ann)->trace = NULL;
+	return failed;
+}
+
+/*
+ * Evaluates ann for the numbers from stack index first up to the top of the
+ * stack and pushes the outputs. The inputs are recorded to trace, if not NULL.
+ */
+static int ann_run_stack(lua_State *L, struct fann *ann, int first, struct ann_trace *trace)
+{
+	int nin, nout, i;
+	fann_type *input, *output;
+
+	nin = lua_gettop(L) - first + 1;
+	if(nin != fann_get_num_input(ann))
+		luaL_error(L, "wrong number of inputs: expected %d, got %d", fann_get_num_input(ann), nin);
+
+	nout = fann_get_num_output(ann);
+
+#ifdef FANN_VERBOSE
+	printf("Evaluating neural net: %d inputs, %d outputs\n", nin, nout);
+#endif
+
+	input = lua_newuserdata(L, nin*(sizeof *input));
+
+	for(i = 0; i < nin; i++)
+	{
+		input[i] = ann_tofann(ann_multiplier(ann), luaL_checknumber(L, i + first));
+#ifdef FANN_VERBOSE
+		printf("Input %d's value is %f\n", i, (double)input[i]);
+#endif
+	}
+
+	if(trace)
+		ann_trace_row(trace, input, 1);
+
+	output = fann_run(ann, input);
+	for(i = 0; i < nout; i++)
+	{
+#ifdef FANN_VERBOSE
+	printf("Output %d's value is %f\n", i, (double)output[i]);
+#endif
+		lua_pushnumber(L, ann_fromfann(ann_multiplier(ann), output[i]));
+	}
+
+	return nout;
+}
+
+/*
+ * Returns the "threads" field of the optional options table at idx,
+ * clamped to 1..ANN_MAX_THREADS.
+ */
+static int ann_optthreads(lua_State *L, int idx)
+{
+	int n = 1;
+
+	if(lua_isnoneornil(L, idx))
+		return n;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+	lua_getfield(L, idx, "threads");
+	if(!lua_isnil(L, -1))
+		n = luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
+
+	if(n < 1)
+		n = 1;
+	if(n > ANN_MAX_THREADS)
+		n = ANN_MAX_THREADS;
+	return n;
+}
+
+/*
+ * Returns the number field name of the optional options table at idx, or def
+ */
+static lua_Number ann_optnumber(lua_State *L, int idx, const char *name, lua_Number def)
+{
+	lua_Number n = def;
+
+	if(lua_isnoneornil(L, idx))
+		return n;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+	lua_getfield(L, idx, name);
+	if(!lua_isnil(L, -1))
+	{
+		if(!lua_isnumber(L, -1))
+			luaL_error(L, "option '%s' must be a number", name);
+		n = lua_tonumber(L, -1);
+	}
+	lua_pop(L, 1);
+
+	return n;
+}
 
-#define FANN_METATABLE "spil.fann"
-#define FANN_TRAIN_METATABLE "spil.fanntrain"
+/*
+ * Calls fn on each of the n argument blocks of size bytes at args, the
+ * first on the calling thread and the others on threads of their own.
+ * Blocks whose thread cannot be started run on the calling thread.
+ */
+static void ann_parallel(int n, void *(*fn)(void *), void *args, size_t size)
+{
+	pthread_t threads[ANN_MAX_THREADS];
+	int started[ANN_MAX_THREADS];
+	char *arg = args;
+	int i;
+
+	for(i = 1; i < n; i++)
+		started[i] = !pthread_create(&threads[i], NULL, fn, arg + i*size);
+
+	fn(arg);
+
+	for(i = 1; i < n; i++)
+	{
+		if(started[i])
+			pthread_join(threads[i], NULL);
+		else
+			fn(arg + i*size);
+	}
+}
 
 /******************************************************************************
 *h Neural Networks
@@ -133,7 +471,9 @@ static int ann_create_standard(lua_State *L)
 		layers[i] = n;
 	}
 
-	ann = lua_newuserdata(L, sizeof *ann);
+	ann = lua_newuserdata(L, sizeof(struct ann_net));
+	((struct ann_net *)ann)->trace = NULL;
+	((struct ann_net *)ann)->input = NULL;
 
 	luaL_getmetatable(L, FANN_METATABLE);
 	lua_setmetatable(L, -2);
@@ -192,7 +532,9 @@ static int ann_create_sparse(lua_State *L)
 		layers[i] = n;
 	}
 
-	ann = lua_newuserdata(L, sizeof *ann);
+	ann = lua_newuserdata(L, sizeof(struct ann_net));
+	((struct ann_net *)ann)->trace = NULL;
+	((struct ann_net *)ann)->input = NULL;
 
 	luaL_getmetatable(L, FANN_METATABLE);
 	lua_setmetatable(L, -2);
@@ -223,7 +565,9 @@ static int ann_create_from_file(lua_State *L)
 	printf("Opening neural net '%s'\n", fname);
 #endif
 
-	ann = lua_newuserdata(L, sizeof *ann);
+	ann = lua_newuserdata(L, sizeof(struct ann_net));
+	((struct ann_net *)ann)->trace = NULL;
+	((struct ann_net *)ann)->input = NULL;
 
 	luaL_getmetatable(L, FANN_METATABLE);
 	lua_setmetatable(L, -2);
@@ -252,9 +596,13 @@ static int ann_close(lua_State *L)
 
 	if(*ann)
 	{
+		if(ann_trace_of(ann))
+			ann_trace_close(ann);
 		fann_destroy(*ann);
 		*ann = NULL;
 	}
+	free(((struct ann_net *)ann)->input);
+	((struct ann_net *)ann)->input = NULL;
 
 	return 0;
 }
@@ -549,6 +897,7 @@ static int ann_set_bit_fail_limit(lua_State *L)
 	return 0;
 }
 
+#ifndef FIXEDFANN
 /*! ann:init_weights(train)
  *# Initializes the weights using Widrow and Nguyen's algorithm based on the
  *# given training data {{train}}.
@@ -577,6 +926,7 @@ static int ann_init_weights(lua_State *L)
 
 	return 0;
 }
+#endif
 
 /*! ann:test_data(train)
  *# Runs the network through the training data in {{train}} and
@@ -609,318 +959,6231 @@ static int ann_test_data(lua_State *L)
 	return 1;
 }
 
-/*! ann:run(input1, input2, ..., inputn)
- *# Evaluates the neural network for the given inputs.
- *x xor = ann:run(-1, 1)
+struct ann_eval_shard
+{
+	struct fann *ann;
+	struct fann_train_data *data;
+	unsigned int first, last, nclasses;
+	const int *symmetric;
+	double bit_fail_limit;
+	double *output_error;
+	unsigned int *confusion;
+	unsigned int bit_fail;
+};
+
+/*
+ * True for the activation functions whose error fann_test() halves
+ */
+static int ann_is_symmetric(enum fann_activationfunc_enum fun)
+{
+	switch(fun)
+	{
+	case FANN_LINEAR_PIECE_SYMMETRIC:
+	case FANN_THRESHOLD_SYMMETRIC:
+	case FANN_SIGMOID_SYMMETRIC:
+	case FANN_SIGMOID_SYMMETRIC_STEPWISE:
+	case FANN_ELLIOT_SYMMETRIC:
+	case FANN_GAUSSIAN_SYMMETRIC:
+	case FANN_SIN_SYMMETRIC:
+	case FANN_COS_SYMMETRIC:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static unsigned int ann_argmax(const fann_type *v, unsigned int n)
+{
+	unsigned int i, best = 0;
+
+	for(i = 1; i < n; i++)
+		if(v[i] > v[best])
+			best = i;
+	return best;
+}
+
+static void *ann_eval_worker(void *arg)
+{
+	struct ann_eval_shard *s = arg;
+	unsigned int nout = s->data->num_output;
+	unsigned int row, i, actual, predicted;
+	unsigned int m = ann_multiplier(s->ann);
+	fann_type *output, *desired;
+	fann_type mid = s->symmetric[0] ? 0 : ann_tofann(m, 0.5);
+	double diff;
+
+	for(row = s->first; row < s->last; row++)
+	{
+		output = fann_run(s->ann, s->data->input[row]);
+		desired = s->data->output[row];
+
+		for(i = 0; i < nout; i++)
+		{
+			diff = ann_fromfann(m, desired[i] - output[i]);
+			if(s->symmetric[i])
+				diff /= 2;
+			s->output_error[i] += (double)diff * diff;
+			if(diff >= s->bit_fail_limit || -diff >= s->bit_fail_limit)
+				s->bit_fail++;
+		}
+
+		if(nout > 1)
+		{
+			actual = ann_argmax(desired, nout);
+			predicted = ann_argmax(output, nout);
+		}
+		else
+		{
+			actual = desired[0] > mid;
+			predicted = output[0] > mid;
+		}
+		s->confusion[actual*s->nclasses + predicted]++;
+	}
+
+	return NULL;
+}
+
+/*! ann:evaluate(train, [options])
+ *# Runs the network through the training data in {{train}} and returns a
+ *# table of metrics gathered in a single pass:\n
+ *{
+ ** {{mse}}: the MSE, as returned by {{ann:test_data()}}
+ ** {{bit_fail}}: the number of outputs off by at least the bit fail limit
+ ** {{output_mse}}: a table with the MSE of each output
+ ** {{confusion}}: a table of rows, {{confusion[actual][predicted]}} counting
+ *# the samples of each class. With several outputs the class is the index of
+ *# the largest output, with a single output it is 2 above the midpoint of the
+ *# activation function and 1 below it
+ ** {{accuracy}}: the fraction of samples classified correctly
+ *}
+ *# The rows are split across {{options.threads}} threads (default 1), each
+ *# evaluating its own copy of the network.
+ *x metrics = ann:evaluate(train, {threads = 4})
  *-
  */
-static int ann_run(lua_State *L)
+static int ann_evaluate(lua_State *L)
 {
 	struct fann **ann;
-
-	int nin, nout, i;
-	fann_type *input, *output;
+	struct fann_train_data **train;
+	struct ann_eval_shard *shards;
+	unsigned int nout, nclasses, rows, i, j, correct;
+	int nthreads, n, t, ok, layer, *symmetric;
+	double sum;
 
 	ann = luaL_checkudata(L, 1, FANN_METATABLE);
 	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
 
-	nin = lua_gettop(L) - 1;
-	if(nin != fann_get_num_input(*ann))
-		luaL_error(L, "wrong number of inputs: expected %d, got %d", fann_get_num_input(*ann), nin);
+	train = luaL_checkudata(L, 2, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 2, "'training data' expected");
+
+	nthreads = ann_optthreads(L, 3);
 
 	nout = fann_get_num_output(*ann);
+	rows = (*train)->num_data;
+	if((*train)->num_input != fann_get_num_input(*ann) || (*train)->num_output != nout)
+		luaL_error(L, "training data does not match the network");
+	if(rows < 1)
+		luaL_error(L, "training data is empty");
+	if((unsigned int)nthreads > rows)
+		nthreads = rows;
+	nclasses = nout > 1 ? nout : 2;
 
 #ifdef FANN_VERBOSE
-	printf("Evaluating neural net: %d inputs, %d outputs\n", nin, nout);
+	printf("Evaluating network on %d rows with %d threads\n", rows, nthreads);
 #endif
 
-	input = lua_newuserdata(L, nin*(sizeof *input));
+	layer = fann_get_num_layers(*ann) - 1;
+	symmetric = lua_newuserdata(L, nout*(sizeof *symmetric));
+	for(i = 0; i < nout; i++)
+		symmetric[i] = ann_is_symmetric(fann_get_activation_function(*ann, layer, i));
 
-	for(i = 0; i < nin; i++)
+	shards = lua_newuserdata(L, nthreads*(sizeof *shards));
+	memset(shards, 0, nthreads*(sizeof *shards));
+	for(n = 0, ok = 1; ok && n < nthreads; n++)
 	{
-		input[i] = luaL_checknumber(L, i + 2);
-#ifdef FANN_VERBOSE
-		printf("Input %d's value is %f\n", i, input[i]);
-#endif
+		struct ann_eval_shard *s = &shards[n];
+
+		s->data = *train;
+		s->first = (unsigned long long)rows*n/nthreads;
+		s->last = (unsigned long long)rows*(n + 1)/nthreads;
+		s->nclasses = nclasses;
+		s->symmetric = symmetric;
+		s->bit_fail_limit = ann_fromfann(ann_multiplier(*ann), fann_get_bit_fail_limit(*ann));
+		s->ann = n ? fann_copy(*ann) : *ann;
+		s->output_error = calloc(1, nout*sizeof(double) + nclasses*nclasses*sizeof(unsigned int));
+		ok = s->ann && s->output_error;
+		if(ok)
+			s->confusion = (unsigned int *)(s->output_error + nout);
 	}
 
-	output = fann_run(*ann, input);
+	if(ok)
+	{
+		ann_parallel(nthreads, ann_eval_worker, shards, sizeof *shards);
+
+		/* Merge into the first shard */
+		for(t = 1; t < nthreads; t++)
+		{
+			for(i = 0; i < nout; i++)
+				shards[0].output_error[i] += shards[t].output_error[i];
+			for(i = 0; i < nclasses*nclasses; i++)
+				shards[0].confusion[i] += shards[t].confusion[i];
+			shards[0].bit_fail += shards[t].bit_fail;
+		}
+	}
+
+	for(t = 1; t < n; t++)
+	{
+		if(shards[t].ann)
+			fann_destroy(shards[t].ann);
+		free(shards[t].output_error);
+	}
+	if(!ok)
+	{
+		free(shards[0].output_error);
+		luaL_error(L, "out of memory");
+	}
+
+	lua_newtable(L);
+
+	sum = 0;
+	lua_newtable(L);
 	for(i = 0; i < nout; i++)
 	{
-#ifdef FANN_VERBOSE
-	printf("Output %d's value is %f\n", i, output[i]);
-#endif
-		lua_pushnumber(L, output[i]);
+		sum += shards[0].output_error[i];
+		lua_pushnumber(L, shards[0].output_error[i] / rows);
+		lua_rawseti(L, -2, i + 1);
 	}
+	lua_setfield(L, -2, "output_mse");
 
-	return nout;
+	lua_pushnumber(L, sum / ((double)rows * nout));
+	lua_setfield(L, -2, "mse");
+
+	lua_pushinteger(L, shards[0].bit_fail);
+	lua_setfield(L, -2, "bit_fail");
+
+	correct = 0;
+	lua_createtable(L, nclasses, 0);
+	for(i = 0; i < nclasses; i++)
+	{
+		lua_createtable(L, nclasses, 0);
+		for(j = 0; j < nclasses; j++)
+		{
+			lua_pushinteger(L, shards[0].confusion[i*nclasses + j]);
+			lua_rawseti(L, -2, j + 1);
+		}
+		lua_rawseti(L, -2, i + 1);
+		correct += shards[0].confusion[i*nclasses + i];
+	}
+	lua_setfield(L, -2, "confusion");
+
+	lua_pushnumber(L, (double)correct / rows);
+	lua_setfield(L, -2, "accuracy");
+
+	free(shards[0].output_error);
+	return 1;
 }
 
-/*! ann:save(file)
- *# Saves a neural network to a file named {{file}}
- *x ann:save("xor_float.net")
+/*! ann:run(input1, input2, ..., inputn)
+ *# Evaluates the neural network for the given inputs.
+ *x xor = ann:run(-1, 1)
  *-
  */
-static int ann_save(lua_State *L)
+static int ann_run(lua_State *L)
 {
 	struct fann **ann;
-	const char *fname;
-
-	if(lua_gettop(L) < 2)
-		luaL_error(L, "insufficient parameters");
 
 	ann = luaL_checkudata(L, 1, FANN_METATABLE);
 	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
 
-	fname = lua_tostring(L, 2);
-#ifdef FANN_VERBOSE
-	printf("Saving neural net to \"%s\"\n", fname);
-#endif
-
-	fann_save(*ann, fname);
-	return 0;
+	return ann_run_stack(L, *ann, 2, ann_trace_of(ann));
 }
 
-/******************************************************************************
-*h Training Sets
-*# These functions are used to create and manage training sets
-******************************************************************************/
-
-/*! fann.read_train_from_file(filename)
- *# Creates a training object by reading a training data file.
- *x train = fann.read_train_from_file("xor.data")
- *-
+/*
+ * Returns the element size of the packed vector type at idx, "float" (the
+ * default) or "double"
  */
-static int ann_read_train_from_file(lua_State *L)
+static size_t ann_packed_size(lua_State *L, int idx)
 {
-	struct fann_train_data **train;
-	const char *fname;
-
-	luaL_argcheck(L, lua_isstring(L,1), 1, "Argument to fann.open_file() must be a string");
+	static const char *const types[] = {"float", "double", NULL};
 
-	fname = lua_tostring(L, 1);
-#ifdef FANN_VERBOSE
-	printf("Opening training data from file '%s'\n", fname);
-#endif
-
-	train = lua_newuserdata(L, sizeof *train);
-
-	luaL_getmetatable(L, FANN_TRAIN_METATABLE);
-	lua_setmetatable(L, -2);
-
-	*train = fann_read_train_from_file(fname);
-	if(!*train)
-		luaL_error(L, "Unable to read train data from %s", fname);
-
-	return 1;
+	return luaL_checkoption(L, idx, "float", types) ? sizeof(double) : sizeof(float);
 }
 
-/*! train:__gc()
- *# Garbage collects training data.
- *-
+/*
+ * Unpacks n elements of size bytes from src, which need not be aligned, as
+ * values of multiplier m
  */
-static int ann_train_close(lua_State *L)
+static void ann_unpack(fann_type *dst, const char *src, unsigned int n, size_t size, unsigned int m)
 {
-	struct fann_train_data **train;
-
-	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
-	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
-
-#ifdef FANN_VERBOSE
-	printf("Closing training data\n");
-#endif
-
-	if(*train)
+	unsigned int i;
+	double d;
+	float f;
+
+	/* Native floating point values are copied as they are */
+	if(size == sizeof(fann_type) && (fann_type)0.5 != 0)
+		memcpy(dst, src, n*size);
+	else if(size == sizeof(double))
 	{
-		fann_destroy_train(*train);
-		*train = NULL;
+		for(i = 0; i < n; i++, src += size)
+		{
+			memcpy(&d, src, size);
+			dst[i] = ann_tofann(m, d);
+		}
+	}
+	else
+	{
+		for(i = 0; i < n; i++, src += size)
+		{
+			memcpy(&f, src, size);
+			dst[i] = ann_tofann(m, f);
+		}
+	}
+}
+
+static void ann_pack(char *dst, const fann_type *src, unsigned int n, size_t size, unsigned int m)
+{
+	unsigned int i;
+	double d;
+	float f;
+
+	if(size == sizeof(fann_type) && (fann_type)0.5 != 0)
+		memcpy(dst, src, n*size);
+	else if(size == sizeof(double))
+	{
+		for(i = 0; i < n; i++, dst += size)
+		{
+			d = ann_fromfann(m, src[i]);
+			memcpy(dst, &d, size);
+		}
+	}
+	else
+	{
+		for(i = 0; i < n; i++, dst += size)
+		{
+			f = ann_fromfann(m, src[i]);
+			memcpy(dst, &f, size);
+		}
+	}
+}
+
+/*! ann:run_packed(inputs, [offset], [type])
+ *# Evaluates the neural network for the inputs packed as native
+ *# {{type}} values ({{"float"}}, the default, or {{"double"}}) in the
+ *# string {{inputs}}, starting at byte {{offset}} (default 1). Returns the
+ *# outputs packed the same way, in one string.
+ *x out = ann:run_packed(string.pack("ff", -1, 1))
+ *-
+ */
+static int ann_run_packed(lua_State *L)
+{
+	struct fann **ann;
+	const char *str;
+	size_t len, size;
+	lua_Integer offset;
+	unsigned int nin, nout;
+	fann_type *input, *output;
+	char *packed;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	str = luaL_checklstring(L, 2, &len);
+	offset = luaL_optinteger(L, 3, 1);
+	size = ann_packed_size(L, 4);
+	nin = fann_get_num_input(*ann);
+	nout = fann_get_num_output(*ann);
+	luaL_argcheck(L, offset >= 1 && offset <= (lua_Integer)len + 1 && nin*size <= len - (offset - 1), 3, "inputs out of range");
+
+	input = lua_newuserdata(L, nin*(sizeof *input) + 1);
+	ann_unpack(input, str + offset - 1, nin, size, ann_multiplier(*ann));
+	if(ann_trace_of(ann))
+		ann_trace_row(ann_trace_of(ann), input, 1);
+
+	output = fann_run(*ann, input);
+
+	packed = lua_newuserdata(L, nout*size);
+	ann_pack(packed, output, nout, size, ann_multiplier(*ann));
+	lua_pushlstring(L, packed, nout*size);
+	return 1;
+}
+
+/*! ann:run_packed_batch(inputs, rows, [stride], [offset], [type])
+ *# Evaluates the neural network for {{rows}} input vectors packed in the
+ *# string {{inputs}} like for {{ann:run_packed()}}, the first starting at
+ *# byte {{offset}} (default 1) and each following {{stride}} bytes after the
+ *# previous one (default: the size of one input vector). Returns the outputs
+ *# of all rows packed back to back in one string.
+ *x out = ann:run_packed_batch(features, 128, 64)
+ *-
+ */
+static int ann_run_packed_batch(lua_State *L)
+{
+	struct fann **ann;
+	const char *str;
+	size_t len, size;
+	lua_Integer offset, stride;
+	unsigned int nin, nout, rows, r;
+	fann_type *input, *output;
+	char *packed;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	str = luaL_checklstring(L, 2, &len);
+	rows = luaL_checkinteger(L, 3);
+	size = ann_packed_size(L, 6);
+	nin = fann_get_num_input(*ann);
+	nout = fann_get_num_output(*ann);
+	stride = luaL_optinteger(L, 4, nin*size);
+	offset = luaL_optinteger(L, 5, 1);
+	luaL_argcheck(L, stride >= (lua_Integer)(nin*size), 4, "stride shorter than one row");
+	luaL_argcheck(L, offset >= 1 && offset <= (lua_Integer)len + 1, 5, "offset out of range");
+	if(rows && ((double)offset - 1 + (double)(rows - 1)*stride + nin*size > len))
+		luaL_error(L, "%d rows do not fit in %d bytes", rows, (int)len);
+
+#ifdef FANN_VERBOSE
+	printf("Evaluating neural net on %d packed rows\n", rows);
+#endif
+
+	input = lua_newuserdata(L, nin*(sizeof *input) + 1);
+	packed = lua_newuserdata(L, (size_t)rows*nout*size + 1);
+	for(r = 0; r < rows; r++)
+	{
+		ann_unpack(input, str + offset - 1 + (size_t)r*stride, nin, size, ann_multiplier(*ann));
+		if(ann_trace_of(ann))
+			ann_trace_row(ann_trace_of(ann), input, r == 0);
+		output = fann_run(*ann, input);
+		ann_pack(packed + (size_t)r*nout*size, output, nout, size, ann_multiplier(*ann));
+	}
+
+	lua_pushlstring(L, packed, (size_t)rows*nout*size);
+	return 1;
+}
+
+/*
+ * Puts the indices of the k largest of the n values in v into idx, largest
+ * first. Returns the number of indices, at most n.
+ */
+static unsigned int ann_topk(const fann_type *v, unsigned int n, unsigned int k, unsigned int *idx)
+{
+	unsigned int i, j, m = 0;
+
+	if(k > n)
+		k = n;
+
+	for(i = 0; i < n; i++)
+	{
+		if(m == k && v[i] <= v[idx[m - 1]])
+			continue;
+		j = m < k ? m++ : m - 1;
+		for(; j > 0 && v[idx[j - 1]] < v[i]; j--)
+			idx[j] = idx[j - 1];
+		idx[j] = i;
 	}
 
+	return m;
+}
+
+/*
+ * Returns the softmax normalization of the n values of multiplier m in v, to
+ * be divided into exp(v[i] - max)
+ */
+static double ann_softmax_sum(const fann_type *v, unsigned int n, fann_type max, unsigned int m)
+{
+	double sum = 0;
+	unsigned int i;
+
+	for(i = 0; i < n; i++)
+		sum += exp(ann_fromfann(m, v[i] - max));
+	return sum;
+}
+
+/*
+ * Classifies output: pushes the best class and its score when k is 0, or
+ * else tables of the k best classes and of their scores
+ */
+static void ann_push_classes(lua_State *L, const fann_type *output, unsigned int n,
+							 unsigned int k, int softmax, unsigned int mult, unsigned int *idx)
+{
+	unsigned int m, i;
+	fann_type max;
+	double sum = 1;
+
+	if(!k)
+	{
+		i = ann_argmax(output, n);
+		lua_pushinteger(L, i + 1);
+		if(softmax)
+			lua_pushnumber(L, 1 / ann_softmax_sum(output, n, output[i], mult));
+		else
+			lua_pushnumber(L, ann_fromfann(mult, output[i]));
+		return;
+	}
+
+	m = ann_topk(output, n, k, idx);
+	max = output[idx[0]];
+	if(softmax)
+		sum = ann_softmax_sum(output, n, max, mult);
+
+	lua_createtable(L, m, 0);
+	lua_createtable(L, m, 0);
+	for(i = 0; i < m; i++)
+	{
+		lua_pushinteger(L, idx[i] + 1);
+		lua_rawseti(L, -3, i + 1);
+		if(softmax)
+			lua_pushnumber(L, exp(ann_fromfann(mult, output[idx[i]] - max)) / sum);
+		else
+			lua_pushnumber(L, ann_fromfann(mult, output[idx[i]]));
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+/*! ann:classify(inputs, [k], [softmax])
+ *# Evaluates the neural network for the table of {{inputs}} and returns
+ *# the index of the largest output and its value. With {{k}}, returns a
+ *# table of the indices of the {{k}} largest outputs, largest first, and a
+ *# table of their values instead. If {{softmax}} is true, the values are
+ *# the softmax normalization of the outputs.
+ *x class, score = ann:classify({0.2, 0.7, 0.1})
+ *x classes, scores = ann:classify(features, 5, true)
+ *-
+ */
+static int ann_classify(lua_State *L)
+{
+	struct fann **ann;
+	unsigned int nin, nout, k, *idx;
+	fann_type *input, *output;
+	int softmax;
+	lua_Integer n;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	nin = fann_get_num_input(*ann);
+	nout = fann_get_num_output(*ann);
+	n = luaL_optinteger(L, 3, 0);
+	luaL_argcheck(L, n >= 0, 3, "k must not be negative");
+	k = n < nout ? n : nout;
+	softmax = lua_toboolean(L, 4);
+
+	input = lua_newuserdata(L, nin*(sizeof *input) + 1);
+	ann_checkvector(L, 2, "inputs", nin, input, ann_multiplier(*ann));
+	idx = lua_newuserdata(L, (k < nout ? k : nout)*(sizeof *idx) + 1);
+	if(ann_trace_of(ann))
+		ann_trace_row(ann_trace_of(ann), input, 1);
+
+	output = fann_run(*ann, input);
+	ann_push_classes(L, output, nout, k, softmax, ann_multiplier(*ann), idx);
+	return 2;
+}
+
+/*! ann:classify_batch(rows, [k], [softmax])
+ *# Classifies each table of inputs in the table {{rows}} like
+ *# {{ann:classify()}}, returning a table with the result of each row: the
+ *# classes, and another table with their values.
+ *x classes, scores = ann:classify_batch({{0.2, 0.7, 0.1}, {0.9, 0.1, 0.3}})
+ *-
+ */
+static int ann_classify_batch(lua_State *L)
+{
+	struct fann **ann;
+	unsigned int nin, nout, k, rows, r, *idx;
+	fann_type *input, *output;
+	int softmax;
+	lua_Integer n;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	nin = fann_get_num_input(*ann);
+	nout = fann_get_num_output(*ann);
+	rows = lua_rawlen(L, 2);
+	n = luaL_optinteger(L, 3, 0);
+	luaL_argcheck(L, n >= 0, 3, "k must not be negative");
+	k = n < nout ? n : nout;
+	softmax = lua_toboolean(L, 4);
+
+#ifdef FANN_VERBOSE
+	printf("Classifying %d rows\n", rows);
+#endif
+
+	input = lua_newuserdata(L, nin*(sizeof *input) + 1);
+	idx = lua_newuserdata(L, (k < nout ? k : nout)*(sizeof *idx) + 1);
+	lua_createtable(L, rows, 0);
+	lua_createtable(L, rows, 0);
+
+	for(r = 0; r < rows; r++)
+	{
+		lua_rawgeti(L, 2, r + 1);
+		ann_checkvector(L, -1, "inputs", nin, input, ann_multiplier(*ann));
+		lua_pop(L, 1);
+		if(ann_trace_of(ann))
+			ann_trace_row(ann_trace_of(ann), input, r == 0);
+
+		output = fann_run(*ann, input);
+		ann_push_classes(L, output, nout, k, softmax, ann_multiplier(*ann), idx);
+		lua_rawseti(L, -3, r + 1);
+		lua_rawseti(L, -3, r + 1);
+	}
+
+	return 2;
+}
+
+/*! ann:save(file)
+ *# Saves a neural network to a file named {{file}}
+ *x ann:save("xor_float.net")
+ *-
+ */
+static int ann_save(lua_State *L)
+{
+	struct fann **ann;
+	const char *fname;
+
+	if(lua_gettop(L) < 2)
+		luaL_error(L, "insufficient parameters");
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	fname = lua_tostring(L, 2);
+#ifdef FANN_VERBOSE
+	printf("Saving neural net to \"%s\"\n", fname);
+#endif
+
+	fann_save(*ann, fname);
 	return 0;
 }
 
-/*! train:__tostring()
- *# Converts training data to a string for Lua's virtual machine
- *x print(train)
+#ifndef FIXEDFANN
+/*! ann:save_to_fixed(file)
+ *# Saves a neural network to a file named {{file}} in fixed point format,
+ *# for the {{fann.fixed}} module. Returns the number of bits after the
+ *# decimal point chosen for the network.
+ *x ann:save_to_fixed("xor_fixed.net")
  *-
  */
-static int ann_train_tostring(lua_State *L)
+static int ann_save_to_fixed(lua_State *L)
+{
+	struct fann **ann;
+	const char *fname;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	fname = luaL_checkstring(L, 2);
+#ifdef FANN_VERBOSE
+	printf("Saving neural net in fixed point format to \"%s\"\n", fname);
+#endif
+
+	lua_pushinteger(L, fann_save_to_fixed(*ann, fname));
+	return 1;
+}
+#endif
+
+/******************************************************************************
+*h Training Sets
+*# These functions are used to create and manage training sets
+******************************************************************************/
+
+/*
+ * A range of whole lines of a training data file, counted and then parsed
+ * by one thread of the parallel loader
+ */
+struct ann_parse_shard
+{
+	const char *begin, *end;
+	unsigned long long first;		/* index of the first number in the range */
+	unsigned long long count;		/* numbers in the range */
+	unsigned long long bad;			/* first number that is not, or ANN_PARSE_OK */
+	unsigned long long total;		/* numbers in the training data */
+	struct fann_train_data *train;	/* NULL while counting */
+};
+
+#define ANN_PARSE_OK (~0ULL)
+
+#define ann_isspace(c) ((c) == ' ' || (c) == '\n' || (c) == '\t' || (c) == '\r' || (c) == '\v' || (c) == '\f')
+
+#if defined(FIXEDFANN)
+#define ann_strtonum(s, end) strtol(s, end, 10)
+#elif defined(DOUBLEFANN)
+#define ann_strtonum(s, end) strtod(s, end)
+#else
+#define ann_strtonum(s, end) strtof(s, end)
+#endif
+
+#ifndef FIXEDFANN
+static const fann_type ann_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#endif
+
+/*
+ * Parses the number in [p, end) into *v exactly as the scanf() FANN reads
+ * training files with would. Returns nonzero if it is not a number.
+ */
+static int ann_parse_number(const char *p, const char *end, fann_type *v)
+{
+	const char *s = p;
+	uint64_t m = 0;
+	int neg = 0, digits = 0, ok;
+	char buf[64], *copy, *tail;
+	size_t len = end - p;
+#ifndef FIXEDFANN
+	int e = 0, eneg = 0, exponent = 0, edigits = 0, frac = 0;
+	fann_type x;
+#endif
+
+	if(s < end && (*s == '-' || *s == '+'))
+		neg = *s++ == '-';
+	for(; s < end && *s >= '0' && *s <= '9' && digits < 19; s++, digits++)
+		m = m*10 + (*s - '0');
+
+#ifdef FIXEDFANN
+	if(s == end && digits && digits < 10)
+	{
+		*v = neg ? -(fann_type)m : (fann_type)m;
+		return 0;
+	}
+#else
+	if(s < end && *s == '.')
+		for(s++; s < end && *s >= '0' && *s <= '9' && digits < 19; s++, digits++, frac++)
+			m = m*10 + (*s - '0');
+	if(digits && s < end && (*s == 'e' || *s == 'E'))
+	{
+		exponent = 1;
+		s++;
+		if(s < end && (*s == '-' || *s == '+'))
+			eneg = *s++ == '-';
+		for(; s < end && *s >= '0' && *s <= '9'; s++, edigits++)
+			if(e < 10000)
+				e = e*10 + (*s - '0');
+	}
+	e = (eneg ? -e : e) - frac;
+
+	/* Clinger's fast path: an exact mantissa and power of ten give the
+	 * correctly rounded value in one operation. With excess precision
+	 * (FLT_EVAL_METHOD != 0) that would round twice, so leave it to libc. */
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+	if(s == end && digits && (edigits || !exponent)
+	   && m <= (sizeof(fann_type) == sizeof(float) ? 1ULL << 24 : 1ULL << 53)
+	   && e >= (sizeof(fann_type) == sizeof(float) ? -10 : -22)
+	   && e <= (sizeof(fann_type) == sizeof(float) ? 10 : 22))
+	{
+		x = (fann_type)m;
+		x = e < 0 ? x / ann_pow10[-e] : x*ann_pow10[e];
+		*v = neg ? -x : x;
+		return 0;
+	}
+#endif
+#endif
+
+	/* Everything else, as scanf() does, like strtof(), strtod() or strtol() */
+	copy = len < sizeof buf ? buf : malloc(len + 1);
+	if(!copy)
+		return 1;
+	memcpy(copy, p, len);
+	copy[len] = '\0';
+	*v = ann_strtonum(copy, &tail);
+	ok = len && tail == copy + len;
+	if(copy != buf)
+		free(copy);
+	return !ok;
+}
+
+static void *ann_parse_worker(void *arg)
+{
+	struct ann_parse_shard *s = arg;
+	struct fann_train_data *train = s->train;
+	const char *p = s->begin, *t;
+	unsigned long long k = s->first, row = 0;
+	unsigned int col = 0, nin = 0, ncols = 1;
+	fann_type *v;
+
+	if(train)
+	{
+		nin = train->num_input;
+		ncols = nin + train->num_output;
+		row = k / ncols;
+		col = k % ncols;
+	}
+
+	for(;;)
+	{
+		while(p < s->end && ann_isspace(*p))
+			p++;
+		if(p == s->end)
+			break;
+		for(t = p; t < s->end && !ann_isspace(*t); t++)
+			;
+
+		if(train && k < s->total)
+		{
+			v = col < nin ? &train->input[row][col] : &train->output[row][col - nin];
+			if(ann_parse_number(p, t, v) && s->bad == ANN_PARSE_OK)
+				s->bad = k;
+			if(++col == ncols)
+			{
+				col = 0;
+				row++;
+			}
+		}
+
+		k++;
+		p = t;
+	}
+
+	s->count = k - s->first;
+	return NULL;
+}
+
+/*
+ * Reads the training data file fname with nthreads threads. Returns the
+ * training data, or NULL with a message in err.
+ */
+static struct fann_train_data *ann_parse_train(const char *fname, int nthreads, char *err, size_t errlen)
+{
+	struct ann_parse_shard shards[ANN_MAX_THREADS];
+	struct fann_train_data *train = NULL;
+	struct stat st;
+	const char *data, *p, *q, *end;
+	unsigned long long total, k;
+	unsigned int header[3], digits;
+	int fd, i, t;
+
+	fd = open(fname, O_RDONLY);
+	if(fd < 0)
+	{
+		snprintf(err, errlen, "%s", strerror(errno));
+		return NULL;
+	}
+	if(fstat(fd, &st))
+	{
+		snprintf(err, errlen, "%s", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	if(st.st_size == 0)
+	{
+		snprintf(err, errlen, "empty file");
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+	{
+		snprintf(err, errlen, "%s", strerror(errno));
+		return NULL;
+	}
+	end = data + st.st_size;
+
+	/* The header: number of rows, inputs and outputs */
+	for(p = data, i = 0; i < 3; i++)
+	{
+		while(p < end && ann_isspace(*p))
+			p++;
+		for(header[i] = 0, digits = 0; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+		{
+			if(header[i] > (UINT_MAX - 9) / 10)
+				break;
+			header[i] = header[i]*10 + (*p - '0');
+		}
+		if(!digits || (p < end && !ann_isspace(*p)))
+		{
+			snprintf(err, errlen, "bad header");
+			goto done;
+		}
+	}
+	total = (unsigned long long)header[0]*(header[1] + header[2]);
+
+#ifdef FANN_VERBOSE
+	printf("Parsing %d rows from %s with %d threads\n", header[0], fname, nthreads);
+#endif
+
+	/* Split the rest into ranges of whole lines */
+	memset(shards, 0, sizeof shards);
+	for(t = 0; t < nthreads; t++)
+	{
+		q = t ? p + (end - p)*t/nthreads : p;
+		if(t && q < shards[t - 1].begin)
+			q = shards[t - 1].begin;
+		while(t && q < end && q[-1] != '\n')
+			q++;
+		shards[t].begin = q;
+		if(t)
+			shards[t - 1].end = q;
+		shards[t].total = total;
+		shards[t].bad = ANN_PARSE_OK;
+	}
+	shards[nthreads - 1].end = end;
+
+	ann_parallel(nthreads, ann_parse_worker, shards, sizeof *shards);
+	for(k = 0, t = 0; t < nthreads; t++)
+	{
+		shards[t].first = k;
+		k += shards[t].count;
+	}
+	if(k < total)
+	{
+		snprintf(err, errlen, "expected %llu numbers, found %llu", total, k);
+		goto done;
+	}
+
+	train = fann_create_train(header[0], header[1], header[2]);
+	if(!train)
+	{
+		snprintf(err, errlen, "out of memory");
+		goto done;
+	}
+	for(t = 0; t < nthreads; t++)
+		shards[t].train = train;
+	ann_parallel(nthreads, ann_parse_worker, shards, sizeof *shards);
+
+	for(t = 0; t < nthreads; t++)
+	{
+		if(shards[t].bad != ANN_PARSE_OK)
+		{
+			k = shards[t].bad;
+			snprintf(err, errlen, "value %llu of row %llu is not a number",
+					 k % (header[1] + header[2]) + 1, k / (header[1] + header[2]) + 1);
+			fann_destroy_train(train);
+			train = NULL;
+			break;
+		}
+	}
+
+done:
+	munmap((void *)data, st.st_size);
+	return train;
+}
+
+/*! fann.read_train_from_file(filename, [options])
+ *# Creates a training object by reading a training data file.\n
+ *# With {{options.threads}}, the file is read by this module instead of
+ *# FANN: it is mapped into memory and split at line boundaries among that
+ *# many threads, which count the numbers of their lines, then parse them
+ *# straight into the training data. The result is the same as FANN's.
+ *x train = fann.read_train_from_file("xor.data")
+ *x train = fann.read_train_from_file("big.data", {threads = 8})
+ *-
+ */
+static int ann_read_train_from_file(lua_State *L)
 {
 	struct fann_train_data **train;
+	const char *fname;
+	char err[128];
 
-	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
-	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+	luaL_argcheck(L, lua_isstring(L,1), 1, "Argument to fann.open_file() must be a string");
+
+	fname = lua_tostring(L, 1);
+#ifdef FANN_VERBOSE
+	printf("Opening training data from file '%s'\n", fname);
+#endif
+
+	train = lua_newuserdata(L, sizeof *train);
+	*train = NULL;
+
+	luaL_getmetatable(L, FANN_TRAIN_METATABLE);
+	lua_setmetatable(L, -2);
+
+	if(!lua_isnoneornil(L, 2))
+	{
+		*train = ann_parse_train(fname, ann_optthreads(L, 2), err, sizeof err);
+		if(!*train)
+			luaL_error(L, "Unable to read train data from %s: %s", fname, err);
+		return 1;
+	}
+
+	*train = fann_read_train_from_file(fname);
+	if(!*train)
+		luaL_error(L, "Unable to read train data from %s", fname);
+
+	return 1;
+}
+
+/*! train:__gc()
+ *# Garbage collects training data.
+ *-
+ */
+static int ann_train_close(lua_State *L)
+{
+	struct fann_train_data **train;
+
+	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+
+#ifdef FANN_VERBOSE
+	printf("Closing training data\n");
+#endif
+
+	if(*train)
+	{
+		fann_destroy_train(*train);
+		*train = NULL;
+	}
+
+	return 0;
+}
+
+/*! train:__tostring()
+ *# Converts training data to a string for Lua's virtual machine
+ *x print(train)
+ *-
+ */
+static int ann_train_tostring(lua_State *L)
+{
+	struct fann_train_data **train;
+
+	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+
+	lua_pushfstring(L, "[[FANN training data]]");
+	return 1;
+}
+
+#ifndef FIXEDFANN
+/*! ann:train_on_file(file, max_epochs, epochs_between_reports, desired_error)
+ *# Trains the neural network on the data in the file {{file}}, for up to
+ *# {{max_epochs}} epochs, reporting every {{epochs_between_reports}}.
+ *# Training stops when the error reaches {{desired_error}}
+ *x ann:train_on_file("xor.data", 500000, 1000, 0.001)
+ *-
+ */
+static int ann_train_on_file(lua_State *L)
+{
+	struct fann **ann;
+	const char *fname;
+	int max_epochs, epochs_between_reports;
+	float desired_error;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	if(lua_gettop(L) < 5)
+		luaL_error(L, "insufficient parameters");
+
+	fname = lua_tostring(L, 2);
+	max_epochs = lua_tointeger(L, 3);
+	epochs_between_reports = lua_tointeger(L, 4);
+	desired_error = lua_tonumber(L, 5);
+
+#ifdef FANN_VERBOSE
+	printf("Training on file \"%s\" for up to %d epochs...\n", fname, max_epochs);
+#endif
+
+	fann_train_on_file(*ann, fname, max_epochs, epochs_between_reports, desired_error);
+	return 0;
+}
+
+/*! ann:train_on_data(train, max_epochs, epochs_between_reports, desired_error)
+ *# Trains the neural network on the data in {{train}}, for up to
+ *# {{max_epochs}} epochs, reporting every {{epochs_between_reports}}.
+ *# Training stops when the error reaches {{desired_error}}
+ *x ann:train_on_data(train, 500000, 1000, 0.001)
+ *-
+ */
+static int ann_train_on_data(lua_State *L)
+{
+	struct fann **ann;
+	struct fann_train_data **train;
+	int max_epochs, epochs_between_reports;
+	float desired_error;
+
+	if(lua_gettop(L) < 5)
+		luaL_error(L, "insufficient parameters");
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	train = luaL_checkudata(L, 2, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+
+	max_epochs = lua_tointeger(L, 3);
+	epochs_between_reports = lua_tointeger(L, 4);
+	desired_error = lua_tonumber(L, 5);
+
+#ifdef FANN_VERBOSE
+	printf("Training on data for up to %d epochs...\n", max_epochs);
+#endif
+
+	fann_train_on_data(*ann, *train, max_epochs, epochs_between_reports, desired_error);
+	return 0;
+}
+
+/*! ann:train(inputs, desired_outputs)
+ *# Trains the neural network one iteration on a single sample.\n
+ *# {{inputs}} and {{desired_outputs}} are tables of numbers.
+ *x ann:train({-1, 1}, {1})
+ *-
+ */
+static int ann_train(lua_State *L)
+{
+	struct fann **ann;
+	unsigned int nin, nout;
+	fann_type *input, *output;
+
+	if(lua_gettop(L) < 3)
+		luaL_error(L, "insufficient parameters");
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	nin = fann_get_num_input(*ann);
+	nout = fann_get_num_output(*ann);
+
+	input = lua_newuserdata(L, (nin + nout)*(sizeof *input));
+	output = input + nin;
+
+	ann_checkvector(L, 2, "inputs", nin, input, ann_multiplier(*ann));
+	ann_checkvector(L, 3, "outputs", nout, output, ann_multiplier(*ann));
+
+#ifdef FANN_VERBOSE
+	printf("Training on a single sample\n");
+#endif
+
+	fann_train(*ann, input, output);
+	return 0;
+}
+
+/*! ann:train_batch(inputs, desired_outputs)
+ *# Trains the neural network on a buffer of samples in a single call and
+ *# returns the MSE measured during the pass.\n
+ *# {{inputs}} and {{desired_outputs}} are tables holding one table of numbers
+ *# per sample. The buffer is visited once with the network's training
+ *# algorithm: {{fann.FANN_TRAIN_INCREMENTAL}} updates the weights after every
+ *# sample, the other algorithms apply one update for the whole buffer.
+ *x mse = ann:train_batch({{-1, 1}, {1, 1}}, {{1}, {-1}})
+ *-
+ */
+static int ann_train_batch(lua_State *L)
+{
+	struct fann **ann;
+	struct fann_train_data data;
+	unsigned int nin, nout, rows, i;
+	fann_type *buf;
+
+	if(lua_gettop(L) < 3)
+		luaL_error(L, "insufficient parameters");
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+	luaL_checktype(L, 2, LUA_TTABLE);
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	rows = lua_rawlen(L, 2);
+	if(rows != lua_rawlen(L, 3))
+		luaL_error(L, "got %d input rows but %d output rows", rows, (int)lua_rawlen(L, 3));
+	if(rows < 1)
+		luaL_error(L, "at least one sample is needed");
+
+	nin = fann_get_num_input(*ann);
+	nout = fann_get_num_output(*ann);
+
+	memset(&data, 0, sizeof data);
+	data.num_data = rows;
+	data.num_input = nin;
+	data.num_output = nout;
+	data.input = lua_newuserdata(L, 2*rows*(sizeof *data.input));
+	data.output = data.input + rows;
+	buf = lua_newuserdata(L, rows*(nin + nout)*(sizeof *buf));
+
+	for(i = 0; i < rows; i++)
+	{
+		data.input[i] = buf + i*nin;
+		data.output[i] = buf + rows*nin + i*nout;
+
+		lua_rawgeti(L, 2, i + 1);
+		ann_checkvector(L, -1, "inputs", nin, data.input[i], ann_multiplier(*ann));
+		lua_pop(L, 1);
+
+		lua_rawgeti(L, 3, i + 1);
+		ann_checkvector(L, -1, "outputs", nout, data.output[i], ann_multiplier(*ann));
+		lua_pop(L, 1);
+	}
+
+#ifdef FANN_VERBOSE
+	printf("Training on a batch of %d samples\n", rows);
+#endif
+
+	lua_pushnumber(L, fann_train_epoch(*ann, &data));
+	return 1;
+}
+#endif
+
+/*! train:save(filename)
+ *# Saves training data to a specified file
+ *x train:save("train.data")
+ *-
+ */
+static int ann_save_train(lua_State *L)
+{
+	struct fann_train_data **train;
+	const char *fname;
+
+	if(lua_gettop(L) < 2)
+		luaL_error(L, "insufficient parameters");
+
+	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+
+	fname = lua_tostring(L, 2);
+
+#ifdef FANN_VERBOSE
+	printf("Saving training data to %s\n", fname);
+#endif
+	fann_save_train(*train, fname);
+	return 0;
+}
+
+#ifndef FIXEDFANN
+/*! train:scale_input(min, max)
+ *# Scales the inputs of training data  to the new range [{{min}}-{{max}}]
+ *x
+ *-
+ */
+static int ann_train_scale_input(lua_State *L)
+{
+	struct fann_train_data **train;
+	fann_type min, max;
+
+	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+
+	min = luaL_checknumber(L, 2);
+	max = luaL_checknumber(L, 3);
+
+#ifdef FANN_VERBOSE
+	printf("Scaling training data inputs to %g - %g\n", (double)min, (double)max);
+#endif
+
+	fann_scale_input_train_data(*train, min, max);
+
+	return 0;
+}
+
+/*! train:scale_output(min, max)
+ *# Scales the outputs of training data to the new range [{{min}}-{{max}}]
+ *x
+ *-
+ */
+static int ann_train_scale_output(lua_State *L)
+{
+	struct fann_train_data **train;
+	fann_type min, max;
+
+	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+
+	min = luaL_checknumber(L, 2);
+	max = luaL_checknumber(L, 3);
+
+#ifdef FANN_VERBOSE
+	printf("Scaling training data outputs to %g - %g\n", (double)min, (double)max);
+#endif
+	fann_scale_output_train_data(*train, min, max);
+
+	return 0;
+}
+
+/*! train:scale(min, max)
+ *# Scales the inputs and outputs of training data to the new range [{{min}}-{{max}}]
+ *x
+ *-
+ */
+static int ann_train_scale(lua_State *L)
+{
+	struct fann_train_data **train;
+	fann_type min, max;
+
+	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+
+	min = luaL_checknumber(L, 2);
+	max = luaL_checknumber(L, 3);
+
+#ifdef FANN_VERBOSE
+	printf("Scaling training data to %g - %g\n", (double)min, (double)max);
+#endif
+
+	fann_scale_train_data(*train, min, max);
+
+	return 0;
+}
+#endif
+
+/*! train:shard(rank, workers)
+ *# Returns worker {{rank}}'s share (counting from 0) of the training data
+ *# split into {{workers}} contiguous shards of nearly equal size, as new
+ *# training data.
+ *x shard = train:shard(rank, 4)
+ *-
+ */
+static int ann_train_shard(lua_State *L)
+{
+	struct fann_train_data **train, **shard;
+	unsigned int first, last;
+	int rank, workers;
+
+	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+	rank = luaL_checkinteger(L, 2);
+	workers = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, workers > 0, 3, "at least one worker expected");
+	luaL_argcheck(L, rank >= 0 && rank < workers, 2, "rank out of range");
+
+	first = (unsigned long long)(*train)->num_data*rank/workers;
+	last = (unsigned long long)(*train)->num_data*(rank + 1)/workers;
+	if(first == last)
+		luaL_error(L, "shard %d of %d is empty", rank, workers);
+
+	shard = lua_newuserdata(L, sizeof *shard);
+	*shard = NULL;
+	luaL_getmetatable(L, FANN_TRAIN_METATABLE);
+	lua_setmetatable(L, -2);
+
+	*shard = fann_subset_train_data(*train, first, last - first);
+	if(!*shard)
+		luaL_error(L, "Unable to create training data shard");
+
+	return 1;
+}
+
+/*
+ * Running statistics of a column of a training set
+ */
+struct ann_column
+{
+	double count, mean, m2, min, max, nan;
+};
+
+/*
+ * A range of rows of a training set, worked on by one thread of
+ * train:stats() or of the transforms
+ */
+struct ann_stats_shard
+{
+	struct fann_train_data *train;
+	unsigned int first, last;
+	struct ann_column *columns;			/* inputs, then outputs */
+	double *sums;						/* room for the sums of the columns */
+	const fann_type *scale, *offset;	/* the transform, likewise */
+	int outputs;						/* whether to transform the outputs */
+};
+
+/*
+ * Adds the row v of n columns to their running sums, kept in one array per
+ * quantity so that the loop has no branch, which compilers vectorize at -O3.
+ * The values are summed less shift, the first value of their column, which
+ * keeps the sum of squares from cancelling out when the mean is large.
+ */
+static void ann_column_add(double *restrict count, double *restrict sum, double *restrict sumsq,
+						   double *restrict min, double *restrict max, const double *restrict shift,
+						   const fann_type *v, unsigned int n)
+{
+	unsigned int i;
+	double x, valid, o, d;
+
+	/* NaNs add nothing, and compare false with min and max */
+	for(i = 0; i < n; i++)
+	{
+		x = v[i];
+		valid = x == x;
+		o = shift[i];
+		d = (valid ? x : o) - o;
+		count[i] += valid;
+		sum[i] += d;
+		sumsq[i] += d*d;
+		min[i] = x < min[i] ? x : min[i];
+		max[i] = x > max[i] ? x : max[i];
+	}
+}
+
+/*
+ * Merges the statistics of b into a, after Chan, Golub and LeVeque
+ */
+static void ann_column_merge(struct ann_column *a, const struct ann_column *b)
+{
+	double n, d;
+
+	a->nan += b->nan;
+	if(!b->count)
+		return;
+
+	n = a->count + b->count;
+	d = b->mean - a->mean;
+	a->m2 += b->m2 + d*d*a->count*b->count / n;
+	a->mean += d*b->count / n;
+	a->count = n;
+	if(b->min < a->min)
+		a->min = b->min;
+	if(b->max > a->max)
+		a->max = b->max;
+}
+
+static void *ann_stats_worker(void *arg)
+{
+	struct ann_stats_shard *s = arg;
+	unsigned int r, i, nin = s->train->num_input, nout = s->train->num_output, ncols = nin + nout;
+	double *shift, *count, *sum, *sumsq, *min, *max, x;
+	struct ann_column *c;
+
+	shift = s->sums;
+	count = shift + ncols;
+	sum = count + ncols;
+	sumsq = sum + ncols;
+	min = sumsq + ncols;
+	max = min + ncols;
+	for(i = 0; i < ncols; i++)
+	{
+		x = i < nin ? s->train->input[s->first][i] : s->train->output[s->first][i - nin];
+		shift[i] = x == x ? x : 0;
+		count[i] = sum[i] = sumsq[i] = 0;
+		min[i] = HUGE_VAL;
+		max[i] = -HUGE_VAL;
+	}
+
+	for(r = s->first; r < s->last; r++)
+	{
+		ann_column_add(count, sum, sumsq, min, max, shift, s->train->input[r], nin);
+		ann_column_add(count + nin, sum + nin, sumsq + nin, min + nin, max + nin, shift + nin,
+					   s->train->output[r], nout);
+	}
+
+	for(i = 0, c = s->columns; i < ncols; i++, c++)
+	{
+		c->count = count[i];
+		c->nan = (s->last - s->first) - count[i];
+		c->min = min[i];
+		c->max = max[i];
+		if(!c->count)
+			continue;
+		c->mean = shift[i] + sum[i] / c->count;
+		c->m2 = sumsq[i] - sum[i]*sum[i] / c->count;
+		if(c->m2 < 0)
+			c->m2 = 0;
+	}
+	return NULL;
+}
+
+/*
+ * Works out the statistics of every column of train with nthreads threads.
+ * Returns them, in a userdata left on the stack.
+ */
+static struct ann_column *ann_compute_stats(lua_State *L, struct fann_train_data *train, int nthreads)
+{
+	struct ann_stats_shard *shards;
+	struct ann_column *columns;
+	unsigned int ncols, i;
+	int t;
+
+	ncols = train->num_input + train->num_output;
+	if((unsigned int)nthreads > train->num_data)
+		nthreads = train->num_data ? train->num_data : 1;
+
+#ifdef FANN_VERBOSE
+	printf("Computing statistics of %d columns with %d threads\n", ncols, nthreads);
+#endif
+
+	shards = lua_newuserdata(L, nthreads*(sizeof *shards)
+							 + (size_t)nthreads*ncols*(sizeof *columns + 6*sizeof(double)));
+	columns = (struct ann_column *)(shards + nthreads);
+	memset(columns, 0, (size_t)nthreads*ncols*sizeof *columns);
+	for(i = 0; i < (unsigned int)nthreads*ncols; i++)
+	{
+		columns[i].min = HUGE_VAL;
+		columns[i].max = -HUGE_VAL;
+	}
+
+	for(t = 0; t < nthreads; t++)
+	{
+		shards[t].train = train;
+		shards[t].first = (unsigned long long)train->num_data*t/nthreads;
+		shards[t].last = (unsigned long long)train->num_data*(t + 1)/nthreads;
+		shards[t].columns = columns + (size_t)t*ncols;
+		shards[t].sums = (double *)(columns + (size_t)nthreads*ncols) + (size_t)t*6*ncols;
+	}
+	if(!train->num_data)
+		return columns;
+	ann_parallel(nthreads, ann_stats_worker, shards, sizeof *shards);
+
+	for(t = 1; t < nthreads; t++)
+		for(i = 0; i < ncols; i++)
+			ann_column_merge(&columns[i], &shards[t].columns[i]);
+
+	return columns;
+}
+
+/*
+ * Pushes a table of the statistics of the n columns c
+ */
+static void ann_push_columns(lua_State *L, const struct ann_column *c, unsigned int n)
+{
+	static const char *const fields[] = {"min", "max", "mean", "variance", "nan"};
+	unsigned int f, i;
+	double v;
+
+	lua_createtable(L, 0, 5);
+	for(f = 0; f < 5; f++)
+	{
+		lua_createtable(L, n, 0);
+		for(i = 0; i < n; i++)
+		{
+			switch(f)
+			{
+				case 0: v = c[i].count ? c[i].min : 0; break;
+				case 1: v = c[i].count ? c[i].max : 0; break;
+				case 2: v = c[i].mean; break;
+				case 3: v = c[i].count ? c[i].m2 / c[i].count : 0; break;
+				default: v = c[i].nan; break;
+			}
+			lua_pushnumber(L, v);
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_setfield(L, -2, fields[f]);
+	}
+}
+
+static void ann_push_stats(lua_State *L, struct fann_train_data *train, const struct ann_column *columns)
+{
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, train->num_data);
+	lua_setfield(L, -2, "rows");
+	ann_push_columns(L, columns, train->num_input);
+	lua_setfield(L, -2, "input");
+	ann_push_columns(L, columns + train->num_input, train->num_output);
+	lua_setfield(L, -2, "output");
+}
+
+/*! train:stats([options])
+ *# Works out in one pass the statistics of every input and output column
+ *# of the training data, and returns them as a table with the number of
+ *# {{rows}}, and tables {{input}} and {{output}} of arrays of the {{min}},
+ *# {{max}}, {{mean}} and (population) {{variance}} of each column,
+ *# leaving NaNs out, and of the number of NaNs, {{nan}}. The rows are split
+ *# among {{options.threads}} threads (1 by default).
+ *x stats = train:stats({threads = 4})
+ *x print(stats.input.mean[1], stats.input.variance[1])
+ *-
+ */
+static int ann_train_stats(lua_State *L)
+{
+	struct fann_train_data **train;
+	struct ann_column *columns;
+
+	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+
+	columns = ann_compute_stats(L, *train, ann_optthreads(L, 2));
+	ann_push_stats(L, *train, columns);
+	return 1;
+}
+
+#ifndef FIXEDFANN
+/*
+ * Reads the statistics of the n columns of side ("input" or "output") from
+ * the stats table at idx, and works out for each column the transform
+ * x*scale + offset that standardizes it or, if normalize is set, that maps
+ * its range onto [lo, hi]
+ */
+static void ann_stats_transform(lua_State *L, int idx, const char *side, unsigned int n,
+								int normalize, double lo, double hi, fann_type *scale, fann_type *offset)
+{
+	const char *first = normalize ? "min" : "mean", *second = normalize ? "max" : "variance";
+	unsigned int i;
+	double s, o;
+
+	lua_getfield(L, idx, side);
+	if(!lua_istable(L, -1))
+		luaL_error(L, "the statistics have no %s columns", side);
+	lua_getfield(L, -1, first);
+	ann_checkvector(L, -1, first, n, scale, 1);
+	lua_getfield(L, -2, second);
+	ann_checkvector(L, -1, second, n, offset, 1);
+	lua_pop(L, 3);
+
+	for(i = 0; i < n; i++)
+	{
+		if(normalize)
+		{
+			s = offset[i] > scale[i] ? (hi - lo) / (offset[i] - scale[i]) : 1;
+			o = offset[i] > scale[i] ? lo - scale[i]*s : (lo + hi) / 2 - scale[i];
+		}
+		else
+		{
+			s = offset[i] > 0 ? 1 / sqrt(offset[i]) : 1;
+			o = -scale[i]*s;
+		}
+		scale[i] = s;
+		offset[i] = o;
+	}
+}
+
+/*
+ * Reads the range and outputs options of the table at idx into lo, hi and
+ * outputs, checking the range if normalize is set
+ */
+static void ann_transform_options(lua_State *L, int idx, int normalize, double *lo, double *hi, int *outputs)
+{
+	if(!lua_isnoneornil(L, idx))
+	{
+		luaL_checktype(L, idx, LUA_TTABLE);
+		lua_getfield(L, idx, "outputs");
+		*outputs = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	*lo = ann_optnumber(L, idx, "min", -1);
+	*hi = ann_optnumber(L, idx, "max", 1);
+	if(normalize && *lo >= *hi)
+		luaL_error(L, "empty range [%f, %f]", *lo, *hi);
+}
+
+static void *ann_transform_worker(void *arg)
+{
+	struct ann_stats_shard *s = arg;
+	unsigned int r, i, nin = s->train->num_input, nout = s->train->num_output;
+	fann_type *v;
+
+	/* Plain loops over the columns, which compilers vectorize at -O3 */
+	for(r = s->first; r < s->last; r++)
+	{
+		v = s->train->input[r];
+		for(i = 0; i < nin; i++)
+			v[i] = v[i]*s->scale[i] + s->offset[i];
+		if(!s->outputs)
+			continue;
+		v = s->train->output[r];
+		for(i = 0; i < nout; i++)
+			v[i] = v[i]*s->scale[nin + i] + s->offset[nin + i];
+	}
+	return NULL;
+}
+
+/*
+ * train:standardize() and train:normalize()
+ */
+static int ann_train_transform(lua_State *L, int normalize)
+{
+	struct fann_train_data **train;
+	struct ann_stats_shard *shards;
+	struct ann_column *columns;
+	fann_type *coef;
+	unsigned int nin, nout, ncols;
+	int nthreads, outputs = 0, stats, t;
+	double lo, hi;
+
+	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+
+	ann_transform_options(L, 3, normalize, &lo, &hi, &outputs);
+	nthreads = ann_optthreads(L, 3);
+	if((unsigned int)nthreads > (*train)->num_data)
+		nthreads = (*train)->num_data ? (*train)->num_data : 1;
+	nin = (*train)->num_input;
+	nout = (*train)->num_output;
+	ncols = nin + nout;
+
+	if(lua_isnoneornil(L, 2))
+	{
+		columns = ann_compute_stats(L, *train, nthreads);
+		ann_push_stats(L, *train, columns);
+		stats = lua_gettop(L);
+	}
+	else
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		stats = 2;
+	}
+
+	coef = lua_newuserdata(L, 2*ncols*sizeof *coef);
+	ann_stats_transform(L, stats, "input", nin, normalize, lo, hi, coef, coef + ncols);
+	if(outputs)
+		ann_stats_transform(L, stats, "output", nout, normalize, lo, hi, coef + nin, coef + ncols + nin);
+
+	shards = lua_newuserdata(L, nthreads*(sizeof *shards));
+	for(t = 0; t < nthreads; t++)
+	{
+		shards[t].train = *train;
+		shards[t].first = (unsigned long long)(*train)->num_data*t/nthreads;
+		shards[t].last = (unsigned long long)(*train)->num_data*(t + 1)/nthreads;
+		shards[t].columns = NULL;
+		shards[t].sums = NULL;
+		shards[t].scale = coef;
+		shards[t].offset = coef + ncols;
+		shards[t].outputs = outputs;
+	}
+	ann_parallel(nthreads, ann_transform_worker, shards, sizeof *shards);
+
+	lua_pushvalue(L, stats);
+	return 1;
+}
+
+/*! train:standardize([stats], [options])
+ *# Standardizes every input column of the training data in place, to a
+ *# mean of 0 and a variance of 1, from the statistics {{stats}} returned by
+ *# {{train:stats()}}, or else from its own. Returns the statistics used, so
+ *# that they can be applied to other data and stored with the network by
+ *# {{ann:set_scaling()}}. {{options}} is a table with these optional
+ *# fields:
+ *{
+ ** {{threads}}: the number of threads to use, 1 by default
+ ** {{outputs}}: whether to transform the output columns as well
+ *}
+ *x stats = train:standardize(nil, {threads = 4})
+ *x test:standardize(stats)
+ *-
+ */
+static int ann_train_standardize(lua_State *L)
+{
+	return ann_train_transform(L, 0);
+}
+
+/*! train:normalize([stats], [options])
+ *# Like {{train:standardize()}}, but maps the range of every column linearly
+ *# onto [{{options.min}}, {{options.max}}], by default [-1, 1].
+ *x stats = train:normalize(nil, {min = 0, max = 1})
+ *-
+ */
+static int ann_train_normalize(lua_State *L)
+{
+	return ann_train_transform(L, 1);
+}
+
+/*! ann:set_scaling(stats, [options])
+ *# Stores the transform of the inputs, and of the outputs if
+ *# {{options.outputs}} is set, that {{train:standardize()}} (or
+ *# {{train:normalize()}} with {{options.method = "normalize"}}) makes with
+ *# the statistics {{stats}} as FANN's scaling parameters of the network, so
+ *# that they are saved with it and applied by {{ann:scale_input()}} and
+ *# {{ann:descale_output()}}.
+ *x ann:set_scaling(train:standardize())
+ *-
+ */
+static int ann_set_scaling(lua_State *L)
+{
+	struct fann **ann;
+	struct fann *a;
+	struct fann_train_data *data;
+	fann_type *coef;
+	unsigned int nin, nout, ncols, i;
+	int normalize = 0, outputs = 0, failed;
+	const char *method;
+	double lo, hi;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+	luaL_checktype(L, 2, LUA_TTABLE);
+	if(lua_istable(L, 3))
+	{
+		lua_getfield(L, 3, "method");
+		if(!lua_isnil(L, -1))
+		{
+			method = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : "";
+			if(strcmp(method, "standardize") && strcmp(method, "normalize"))
+				luaL_error(L, "options.method must be 'standardize' or 'normalize'");
+			normalize = !strcmp(method, "normalize");
+		}
+		lua_pop(L, 1);
+	}
+	ann_transform_options(L, 3, normalize, &lo, &hi, &outputs);
+
+	a = *ann;
+	nin = fann_get_num_input(a);
+	nout = fann_get_num_output(a);
+	ncols = nin + nout;
+	coef = lua_newuserdata(L, 2*ncols*sizeof *coef);
+	ann_stats_transform(L, 2, "input", nin, normalize, lo, hi, coef, coef + ncols);
+	if(outputs)
+		ann_stats_transform(L, 2, "output", nout, normalize, lo, hi, coef + nin, coef + ncols + nin);
+
+	/* FANN allocates its scaling parameters when it first works them out */
+	if(!a->scale_mean_in)
+	{
+		data = fann_create_train(1, nin, nout);
+		failed = !data || fann_set_input_scaling_params(a, data, -1, 1);
+		if(data)
+			fann_destroy_train(data);
+		if(failed)
+			luaL_error(L, "Unable to allocate the scaling parameters");
+	}
+
+	/* FANN scales x to ((x - mean)/deviation + 1)*factor + new_min */
+	for(i = 0; i < nin; i++)
+	{
+		a->scale_mean_in[i] = -coef[ncols + i] / coef[i];
+		a->scale_deviation_in[i] = 1 / coef[i];
+		a->scale_new_min_in[i] = -1;
+		a->scale_factor_in[i] = 1;
+	}
+	for(i = 0; outputs && i < nout; i++)
+	{
+		a->scale_mean_out[i] = -coef[ncols + nin + i] / coef[nin + i];
+		a->scale_deviation_out[i] = 1 / coef[nin + i];
+		a->scale_new_min_out[i] = -1;
+		a->scale_factor_out[i] = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * ann:scale_input() and ann:descale_output()
+ */
+static int ann_scale_vector(lua_State *L, int input)
+{
+	struct fann **ann;
+	fann_type *v;
+	unsigned int n, i;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+	if(!(*ann)->scale_mean_in)
+		luaL_error(L, "the neural net has no scaling parameters");
+
+	n = input ? fann_get_num_input(*ann) : fann_get_num_output(*ann);
+	v = lua_newuserdata(L, n*(sizeof *v) + 1);
+	ann_checkvector(L, 2, input ? "inputs" : "outputs", n, v, 1);
+	if(input)
+		fann_scale_input(*ann, v);
+	else
+		fann_descale_output(*ann, v);
+
+	lua_createtable(L, n, 0);
+	for(i = 0; i < n; i++)
+	{
+		lua_pushnumber(L, v[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+/*! ann:scale_input(inputs)
+ *# Returns the table {{inputs}} scaled with the network's scaling
+ *# parameters, as they were set by {{ann:set_scaling()}}
+ *x out = ann:run(unpack(ann:scale_input({3.2, 140, 0.5})))
+ *-
+ */
+static int ann_scale_input(lua_State *L)
+{
+	return ann_scale_vector(L, 1);
+}
+
+/*! ann:descale_output(outputs)
+ *# Returns the table {{outputs}} of the network mapped back to the scale of
+ *# the training data, undoing the scaling of the outputs set by
+ *# {{ann:set_scaling()}}
+ *x value = ann:descale_output({ann:run(unpack(inputs))})[1]
+ *-
+ */
+static int ann_descale_output(lua_State *L)
+{
+	return ann_scale_vector(L, 0);
+}
+#endif
+
+#ifndef FIXEDFANN
+/******************************************************************************
+*h Training Jobs
+*# A training job trains a network in slices of a few epochs, so that
+*# coroutine-based hosts can keep serving other work while a model
+*# retrains. The network keeps its training state (RPROP steps, previous
+*# slopes and so on) between slices, so slicing does not change the result.
+******************************************************************************/
+
+struct ann_train_job
+{
+	struct fann **ann;
+	struct fann_train_data **train;
+	int ann_ref, train_ref;
+	unsigned int max_epochs, epochs_per_slice, epoch;
+	float desired_error, mse;
+	int done;
+};
+
+/*
+ * Same stop criteria as fann_train_on_data()
+ */
+static int ann_desired_error_reached(struct fann *ann, float desired_error)
+{
+	if(fann_get_train_stop_function(ann) == FANN_STOPFUNC_BIT)
+		return fann_get_bit_fail(ann) <= (unsigned int)desired_error;
+	return fann_get_MSE(ann) <= desired_error;
+}
+
+/*
+ * Trains one slice of epochs_per_slice epochs. Returns non-zero when the
+ * job has finished.
+ */
+static int ann_train_job_slice(lua_State *L, struct ann_train_job *job)
+{
+	unsigned int i;
+
+	if(!*job->ann || !*job->train)
+		luaL_error(L, "network or training data of the job was collected");
+
+	for(i = 0; i < job->epochs_per_slice && !job->done; i++)
+	{
+		job->mse = fann_train_epoch(*job->ann, *job->train);
+		job->epoch++;
+		if(job->epoch >= job->max_epochs || ann_desired_error_reached(*job->ann, job->desired_error))
+			job->done = 1;
+	}
+
+	return job->done;
+}
+
+/*! ann:train_job(train, max_epochs, epochs_per_slice, desired_error)
+ *# Creates a training job that trains the network on {{train}} for up to
+ *# {{max_epochs}} epochs, or until the error reaches {{desired_error}},
+ *# running {{epochs_per_slice}} epochs at a time.
+ *x job = ann:train_job(train, 500000, 100, 0.001)
+ *-
+ */
+static int ann_train_job_create(lua_State *L)
+{
+	struct fann **ann;
+	struct fann_train_data **train;
+	struct ann_train_job *job;
+	lua_Integer max_epochs, epochs_per_slice;
+
+	if(lua_gettop(L) < 5)
+		luaL_error(L, "insufficient parameters");
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	train = luaL_checkudata(L, 2, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 2, "'training data' expected");
+
+	max_epochs = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, max_epochs >= 1 && max_epochs <= UINT_MAX, 3, "max_epochs must be positive");
+	epochs_per_slice = luaL_checkinteger(L, 4);
+	luaL_argcheck(L, epochs_per_slice >= 1 && epochs_per_slice <= UINT_MAX, 4, "slices must have at least one epoch");
+
+	job = lua_newuserdata(L, sizeof *job);
+	memset(job, 0, sizeof *job);
+	job->ann = ann;
+	job->train = train;
+	job->max_epochs = max_epochs;
+	job->epochs_per_slice = epochs_per_slice;
+	job->desired_error = luaL_checknumber(L, 5);
+
+	lua_pushvalue(L, 1);
+	job->ann_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, 2);
+	job->train_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	luaL_getmetatable(L, FANN_TRAIN_JOB_METATABLE);
+	lua_setmetatable(L, -2);
+
+#ifdef FANN_VERBOSE
+	printf("Creating training job: up to %d epochs, %d per slice\n", max_epochs, epochs_per_slice);
+#endif
+
+	return 1;
+}
+
+/*! job:step()
+ *# Trains one slice of epochs and returns whether the job has finished,
+ *# the number of epochs trained so far and the MSE of the last epoch.
+ *# This works on every Lua version.
+ *x while not job:step() do coroutine.yield() end
+ *-
+ */
+static int ann_train_job_step(lua_State *L)
+{
+	struct ann_train_job *job;
+
+	job = luaL_checkudata(L, 1, FANN_TRAIN_JOB_METATABLE);
+	luaL_argcheck(L, job != NULL, 1, "'training job' expected");
+
+	lua_pushboolean(L, ann_train_job_slice(L, job));
+	lua_pushinteger(L, job->epoch);
+	lua_pushnumber(L, job->mse);
+	return 3;
+}
+
+#if LUA_VERSION_NUM > 501
+static int ann_train_job_loop(lua_State *L);
+
+#if LUA_VERSION_NUM > 502
+static int ann_train_job_continue(lua_State *L, int status, lua_KContext ctx)
+{
+	return ann_train_job_loop(L);
+}
+#else
+static int ann_train_job_continue(lua_State *L)
+{
+	return ann_train_job_loop(L);
+}
+#endif
+
+static int ann_train_job_loop(lua_State *L)
+{
+	struct ann_train_job *job;
+	int yieldable;
+
+	job = luaL_checkudata(L, 1, FANN_TRAIN_JOB_METATABLE);
+	lua_settop(L, 1);
+
+#if LUA_VERSION_NUM > 502
+	yieldable = lua_isyieldable(L);
+#else
+	yieldable = !lua_pushthread(L);
+	lua_pop(L, 1);
+#endif
+
+	while(!ann_train_job_slice(L, job))
+	{
+		if(yieldable)
+		{
+			lua_pushinteger(L, job->epoch);
+			lua_pushnumber(L, job->mse);
+			return lua_yieldk(L, 2, 0, ann_train_job_continue);
+		}
+	}
+
+	lua_pushinteger(L, job->epoch);
+	lua_pushnumber(L, job->mse);
+	return 2;
+}
+
+/*! job:run()
+ *# Trains until the job has finished and returns the number of epochs
+ *# trained and the final MSE.\n
+ *# Called from a coroutine, it yields the epoch count and MSE after every
+ *# slice and carries on when resumed. Called from the main thread, it
+ *# trains without yielding.
+ *x co = coroutine.wrap(function() return job:run() end)
+ *-
+ */
+static int ann_train_job_run(lua_State *L)
+{
+	luaL_checkudata(L, 1, FANN_TRAIN_JOB_METATABLE);
+	return ann_train_job_loop(L);
+}
+#else
+/* Lua 5.1 and LuaJIT cannot yield from a C function and carry on, so
+ * job:run() is a Lua loop around job:step() there.
+ */
+static const char ann_train_job_run_lua[] =
+	"local running, yield = coroutine.running, coroutine.yield\n"
+	"return function(job)\n"
+	"	local done, epoch, mse = job:step()\n"
+	"	while not done do\n"
+	"		if running() then yield(epoch, mse) end\n"
+	"		done, epoch, mse = job:step()\n"
+	"	end\n"
+	"	return epoch, mse\n"
+	"end\n";
+#endif
+
+/*! job:__gc()
+ *# Garbage collects the training job.
+ *-
+ */
+static int ann_train_job_close(lua_State *L)
+{
+	struct ann_train_job *job;
+
+	job = luaL_checkudata(L, 1, FANN_TRAIN_JOB_METATABLE);
+	luaL_argcheck(L, job != NULL, 1, "'training job' expected");
+
+	luaL_unref(L, LUA_REGISTRYINDEX, job->ann_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, job->train_ref);
+	job->ann_ref = job->train_ref = LUA_NOREF;
+
+	return 0;
+}
+
+/*! job:__tostring()
+ *# Converts a training job to a string for Lua's virtual machine
+ *x print(job)
+ *-
+ */
+static int ann_train_job_tostring(lua_State *L)
+{
+	struct ann_train_job *job;
+
+	job = luaL_checkudata(L, 1, FANN_TRAIN_JOB_METATABLE);
+	luaL_argcheck(L, job != NULL, 1, "'training job' expected");
+
+	lua_pushfstring(L, "[[FANN training job: %d %d]]", job->epoch, job->max_epochs);
+	return 1;
+}
+
+/******************************************************************************
+*h Checkpoints
+*# Checkpointed training periodically writes the network's weights together
+*# with the training algorithm's state (RPROP step sizes, previous slopes,
+*# quickprop and momentum deltas, the SARPROP epoch that sets its
+*# temperature) and the epoch counter to a binary file, so
+*# that an interrupted run can be resumed exactly where it stopped.
+*# Checkpoints are written by a background thread to a temporary file that
+*# is then renamed over the checkpoint, so a checkpoint on disk is always
+*# complete. The file uses the machine's native byte order and {{fann_type}}.
+******************************************************************************/
+
+#define ANN_CHECKPOINT_MAGIC "LFANNCK2"
+
+/* Bits of ann_checkpoint.arrays for the training arrays that follow the weights */
+#define ANN_CHECKPOINT_SLOPES		1
+#define ANN_CHECKPOINT_STEPS		2
+#define ANN_CHECKPOINT_PREV_SLOPES	4
+#define ANN_CHECKPOINT_DELTAS		8
+
+struct ann_checkpoint
+{
+	char magic[8];
+	uint32_t type_size;
+	uint32_t num_input, num_output, total_neurons, total_connections;
+	uint32_t training_algorithm;
+	uint32_t epoch, max_epochs, every_epochs, every_seconds;
+	float desired_error, mse;
+	uint32_t arrays;
+	uint32_t sarprop_epoch;
+};
+
+struct ann_checkpoint_writer
+{
+	pthread_t thread;
+	int running, failed;
+	const char *path;
+	char *buf;
+	size_t size;
+};
+
+/*
+ * Returns the training arrays of ann in checkpoint order
+ */
+static void ann_checkpoint_arrays(struct fann *ann, fann_type ***arrays)
+{
+	arrays[0] = &ann->train_slopes;
+	arrays[1] = &ann->prev_steps;
+	arrays[2] = &ann->prev_train_slopes;
+	arrays[3] = &ann->prev_weights_deltas;
+}
+
+static void *ann_checkpoint_write(void *arg)
+{
+	struct ann_checkpoint_writer *w = arg;
+	size_t len = strlen(w->path);
+	char *tmp;
+	FILE *f;
+
+	w->failed = 1;
+	tmp = malloc(len + 5);
+	if(!tmp)
+		return NULL;
+	memcpy(tmp, w->path, len);
+	strcpy(tmp + len, ".tmp");
+
+	f = fopen(tmp, "wb");
+	if(f)
+	{
+		w->failed = fwrite(w->buf, 1, w->size, f) != w->size;
+		w->failed |= fflush(f) != 0 || fsync(fileno(f)) != 0;
+		w->failed |= fclose(f) != 0;
+		if(!w->failed)
+			w->failed = rename(tmp, w->path) != 0;
+		else
+			remove(tmp);
+	}
+
+	free(tmp);
+	return NULL;
+}
+
+/*
+ * Waits for the checkpoint being written, if any. Returns non-zero if it
+ * could not be written.
+ */
+static int ann_checkpoint_wait(struct ann_checkpoint_writer *w)
+{
+	if(w->running)
+	{
+		pthread_join(w->thread, NULL);
+		w->running = 0;
+		free(w->buf);
+		w->buf = NULL;
+		return w->failed;
+	}
+	return 0;
+}
+
+/*
+ * Copies the state of ann into a buffer and starts writing it in the
+ * background. Returns non-zero on failure.
+ */
+static int ann_checkpoint_start(struct ann_checkpoint_writer *w, struct fann *ann, struct ann_checkpoint *cp)
+{
+	fann_type **arrays[4];
+	size_t n = ann->total_connections*sizeof(fann_type);
+	char *p;
+	int i;
+
+	if(ann_checkpoint_wait(w))
+		return 1;
+
+	ann_checkpoint_arrays(ann, arrays);
+	cp->sarprop_epoch = ann->sarprop_epoch;
+	cp->arrays = 0;
+	w->size = sizeof *cp + n;
+	for(i = 0; i < 4; i++)
+	{
+		if(*arrays[i])
+		{
+			cp->arrays |= 1 << i;
+			w->size += n;
+		}
+	}
+
+	w->buf = malloc(w->size);
+	if(!w->buf)
+		return 1;
+
+	memcpy(w->buf, cp, sizeof *cp);
+	p = w->buf + sizeof *cp;
+	memcpy(p, ann->weights, n);
+	for(i = 0; i < 4; i++)
+	{
+		if(*arrays[i])
+		{
+			p += n;
+			memcpy(p, *arrays[i], n);
+		}
+	}
+
+	if(pthread_create(&w->thread, NULL, ann_checkpoint_write, w))
+	{
+		ann_checkpoint_write(w);
+		free(w->buf);
+		w->buf = NULL;
+		return w->failed;
+	}
+	w->running = 1;
+
+	return 0;
+}
+
+/*
+ * Trains from cp->epoch up to cp->max_epochs, writing checkpoints to path
+ */
+static void ann_train_checkpointed_loop(lua_State *L, struct fann *ann, struct fann_train_data *train,
+										struct ann_checkpoint *cp, const char *path)
+{
+	struct ann_checkpoint_writer w;
+	time_t last = time(NULL);
+	int done = 0, failed = 0;
+
+	memset(&w, 0, sizeof w);
+	w.path = path;
+
+	while(!done && !failed && cp->epoch < cp->max_epochs)
+	{
+		cp->mse = fann_train_epoch(ann, train);
+		cp->epoch++;
+		done = ann_desired_error_reached(ann, cp->desired_error);
+
+		if(done || cp->epoch == cp->max_epochs
+		   || (cp->every_epochs && cp->epoch % cp->every_epochs == 0)
+		   || (cp->every_seconds && time(NULL) - last >= (time_t)cp->every_seconds))
+		{
+#ifdef FANN_VERBOSE
+			printf("Checkpointing epoch %d to %s\n", cp->epoch, path);
+#endif
+			failed = ann_checkpoint_start(&w, ann, cp);
+			last = time(NULL);
+		}
+	}
+
+	failed |= ann_checkpoint_wait(&w);
+	if(failed)
+		luaL_error(L, "Unable to write checkpoint %s", path);
+}
+
+/*! ann:train_checkpointed(train, max_epochs, desired_error, checkpoint, epochs, [seconds])
+ *# Trains the neural network on the data in {{train}} like
+ *# {{ann:train_on_data()}}, writing a checkpoint to the file {{checkpoint}}
+ *# every {{epochs}} epochs and every {{seconds}} seconds (0 disables either),
+ *# and once training stops. Returns the number of epochs trained and the
+ *# final MSE.
+ *x ann:train_checkpointed(train, 500000, 0.001, "xor.ckpt", 1000, 60)
+ *-
+ */
+static int ann_train_checkpointed(lua_State *L)
+{
+	struct fann **ann;
+	struct fann_train_data **train;
+	struct ann_checkpoint cp;
+	const char *path;
+	lua_Integer n;
+
+	if(lua_gettop(L) < 6)
+		luaL_error(L, "insufficient parameters");
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	train = luaL_checkudata(L, 2, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 2, "'training data' expected");
+
+	memset(&cp, 0, sizeof cp);
+	memcpy(cp.magic, ANN_CHECKPOINT_MAGIC, sizeof cp.magic);
+	cp.type_size = sizeof(fann_type);
+	cp.num_input = fann_get_num_input(*ann);
+	cp.num_output = fann_get_num_output(*ann);
+	cp.total_neurons = fann_get_total_neurons(*ann);
+	cp.total_connections = fann_get_total_connections(*ann);
+	cp.training_algorithm = fann_get_training_algorithm(*ann);
+	n = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, n >= 1 && n <= UINT32_MAX, 3, "max_epochs must be positive");
+	cp.max_epochs = n;
+	cp.desired_error = luaL_checknumber(L, 4);
+	path = luaL_checkstring(L, 5);
+	n = luaL_checkinteger(L, 6);
+	luaL_argcheck(L, n >= 0 && n <= UINT32_MAX, 6, "epochs must not be negative");
+	cp.every_epochs = n;
+	n = luaL_optinteger(L, 7, 0);
+	luaL_argcheck(L, n >= 0 && n <= UINT32_MAX, 7, "seconds must not be negative");
+	cp.every_seconds = n;
+
+#ifdef FANN_VERBOSE
+	printf("Training with checkpoints to %s for up to %d epochs...\n", path, cp.max_epochs);
+#endif
+
+	ann_train_checkpointed_loop(L, *ann, *train, &cp, path);
+
+	lua_pushinteger(L, cp.epoch);
+	lua_pushnumber(L, cp.mse);
+	return 2;
+}
+
+/*! ann:resume_training(checkpoint, train, [max_epochs])
+ *# Restores the weights and training state saved in the file {{checkpoint}}
+ *# and carries on training on {{train}} where the checkpointed run stopped,
+ *# with the same limits and checkpoint schedule, or up to {{max_epochs}}
+ *# epochs in total if given. {{ann}} must have the topology of the
+ *# checkpointed network, e.g. be loaded from a file saved before training
+ *# started, and keep the same training parameters. Returns the number of
+ *# epochs trained in total and the final MSE.
+ *x ann = fann.create_from_file("xor_untrained.net")
+ *x ann:resume_training("xor.ckpt", train)
+ *-
+ */
+static int ann_resume_training(lua_State *L)
+{
+	struct fann **ann;
+	struct fann_train_data **train;
+	struct ann_checkpoint cp;
+	fann_type **arrays[4];
+	const char *path;
+	size_t n;
+	lua_Integer max_epochs;
+	FILE *f;
+	int i, ok;
+
+	if(lua_gettop(L) < 3)
+		luaL_error(L, "insufficient parameters");
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	path = luaL_checkstring(L, 2);
+
+	train = luaL_checkudata(L, 3, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 3, "'training data' expected");
+
+	max_epochs = luaL_optinteger(L, 4, 1);
+	luaL_argcheck(L, max_epochs >= 1 && max_epochs <= UINT32_MAX, 4, "max_epochs must be positive");
+
+#ifdef FANN_VERBOSE
+	printf("Resuming training from %s\n", path);
+#endif
+
+	f = fopen(path, "rb");
+	if(!f)
+		luaL_error(L, "Unable to open checkpoint %s", path);
+
+	if(fread(&cp, sizeof cp, 1, f) != 1 || memcmp(cp.magic, ANN_CHECKPOINT_MAGIC, sizeof cp.magic)
+	   || cp.type_size != sizeof(fann_type))
+	{
+		fclose(f);
+		luaL_error(L, "%s is not a checkpoint of this build", path);
+	}
+
+	if(cp.num_input != fann_get_num_input(*ann) || cp.num_output != fann_get_num_output(*ann)
+	   || cp.total_neurons != fann_get_total_neurons(*ann)
+	   || cp.total_connections != fann_get_total_connections(*ann))
+	{
+		fclose(f);
+		luaL_error(L, "checkpoint %s does not match the network", path);
+	}
+
+	n = cp.total_connections;
+	ok = fread((*ann)->weights, sizeof(fann_type), n, f) == n;
+
+	ann_checkpoint_arrays(*ann, arrays);
+	for(i = 0; ok && i < 4; i++)
+	{
+		if(!(cp.arrays & (1 << i)))
+			continue;
+		if(!*arrays[i])
+			*arrays[i] = calloc((*ann)->total_connections_allocated, sizeof(fann_type));
+		ok = *arrays[i] && fread(*arrays[i], sizeof(fann_type), n, f) == n;
+	}
+	fclose(f);
+
+	if(!ok)
+		luaL_error(L, "Unable to read checkpoint %s", path);
+
+	if(!lua_isnoneornil(L, 4))
+		cp.max_epochs = max_epochs;
+	(*ann)->sarprop_epoch = cp.sarprop_epoch;
+	fann_set_training_algorithm(*ann, cp.training_algorithm);
+	ann_train_checkpointed_loop(L, *ann, *train, &cp, path);
+
+	lua_pushinteger(L, cp.epoch);
+	lua_pushnumber(L, cp.mse);
+	return 2;
+}
+
+/******************************************************************************
+*h Mini-batch Training
+*# Besides FANN's own training algorithms, networks created by
+*# {{fann.create_standard()}} can be trained by a mini-batch trainer built
+*# into this module. It copies the weights into one dense matrix per layer,
+*# runs the forward and backward passes for a whole mini-batch at a time with
+*# blocked matrix kernels, and writes the weights back into the network when
+*# training stops.
+******************************************************************************/
+
+#define ANN_BLOCK 64
+
+/*
+ * C (m x n) = A (m x k) * B^T, with B being n x k
+ */
+static void ann_gemm_nt(unsigned int m, unsigned int n, unsigned int k,
+						const fann_type *a, unsigned int lda, const fann_type *b, unsigned int ldb,
+						fann_type *c, unsigned int ldc)
+{
+	unsigned int i0, j0, i, j, p, iend, jend;
+	const fann_type *ar, *br;
+	fann_type sum;
+
+	for(i0 = 0; i0 < m; i0 += ANN_BLOCK)
+	{
+		iend = i0 + ANN_BLOCK < m ? i0 + ANN_BLOCK : m;
+		for(j0 = 0; j0 < n; j0 += ANN_BLOCK)
+		{
+			jend = j0 + ANN_BLOCK < n ? j0 + ANN_BLOCK : n;
+			for(i = i0; i < iend; i++)
+			{
+				ar = a + (size_t)i*lda;
+				for(j = j0; j < jend; j++)
+				{
+					br = b + (size_t)j*ldb;
+					sum = 0;
+					for(p = 0; p < k; p++)
+						sum += ar[p] * br[p];
+					c[(size_t)i*ldc + j] = sum;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * C (m x n) = A (m x k) * B, with B being k x n
+ */
+static void ann_gemm_nn(unsigned int m, unsigned int n, unsigned int k,
+						const fann_type *a, unsigned int lda, const fann_type *b, unsigned int ldb,
+						fann_type *c, unsigned int ldc)
+{
+	unsigned int p0, i, j, p, pend;
+	const fann_type *br;
+	fann_type *cr, aip;
+
+	for(i = 0; i < m; i++)
+		memset(c + (size_t)i*ldc, 0, n*sizeof(fann_type));
+
+	for(p0 = 0; p0 < k; p0 += ANN_BLOCK)
+	{
+		pend = p0 + ANN_BLOCK < k ? p0 + ANN_BLOCK : k;
+		for(i = 0; i < m; i++)
+		{
+			cr = c + (size_t)i*ldc;
+			for(p = p0; p < pend; p++)
+			{
+				aip = a[(size_t)i*lda + p];
+				br = b + (size_t)p*ldb;
+				for(j = 0; j < n; j++)
+					cr[j] += aip * br[j];
+			}
+		}
+	}
+}
+
+/*
+ * C (m x n) = A^T * B, with A being k x m and B being k x n
+ */
+static void ann_gemm_tn(unsigned int m, unsigned int n, unsigned int k,
+						const fann_type *a, unsigned int lda, const fann_type *b, unsigned int ldb,
+						fann_type *c, unsigned int ldc)
+{
+	unsigned int i0, i, j, p, iend;
+	const fann_type *br;
+	fann_type *cr, api;
+
+	for(i = 0; i < m; i++)
+		memset(c + (size_t)i*ldc, 0, n*sizeof(fann_type));
+
+	for(i0 = 0; i0 < m; i0 += ANN_BLOCK)
+	{
+		iend = i0 + ANN_BLOCK < m ? i0 + ANN_BLOCK : m;
+		for(p = 0; p < k; p++)
+		{
+			br = b + (size_t)p*ldb;
+			for(i = i0; i < iend; i++)
+			{
+				api = a[(size_t)p*lda + i];
+				cr = c + (size_t)i*ldc;
+				for(j = 0; j < n; j++)
+					cr[j] += api * br[j];
+			}
+		}
+	}
+}
+
+/*
+ * One fully connected layer of the dense copy of a network
+ */
+struct ann_dense
+{
+	unsigned int nin, nout;		/* nin does not count the bias */
+	fann_type *w, *g, *m, *v;	/* nout rows of nin + 1 weights, bias last */
+	fann_type *steepness;
+	enum fann_activationfunc_enum *fun;
+	fann_type *sum;				/* batch x nout, steepness * weighted sum */
+	fann_type *out;				/* batch x (nout + 1), bias column last */
+	fann_type *delta;			/* batch x nout */
+	struct fann_neuron *neurons;
+};
+
+static int ann_dense_supported(enum fann_activationfunc_enum fun)
+{
+	switch(fun)
+	{
+	case FANN_LINEAR:
+	case FANN_SIGMOID:
+	case FANN_SIGMOID_STEPWISE:
+	case FANN_SIGMOID_SYMMETRIC:
+	case FANN_SIGMOID_SYMMETRIC_STEPWISE:
+	case FANN_GAUSSIAN:
+	case FANN_GAUSSIAN_SYMMETRIC:
+	case FANN_ELLIOT:
+	case FANN_ELLIOT_SYMMETRIC:
+	case FANN_LINEAR_PIECE:
+	case FANN_LINEAR_PIECE_SYMMETRIC:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * The activation functions of fann_activation.h, for x = steepness * sum.
+ * The stepwise sigmoids are trained as the sigmoids they approximate.
+ */
+static fann_type ann_dense_activation(enum fann_activationfunc_enum fun, fann_type x)
+{
+	switch(fun)
+	{
+	case FANN_SIGMOID:
+	case FANN_SIGMOID_STEPWISE:
+		return 1 / (1 + exp(-2 * x));
+	case FANN_SIGMOID_SYMMETRIC:
+	case FANN_SIGMOID_SYMMETRIC_STEPWISE:
+		return 2 / (1 + exp(-2 * x)) - 1;
+	case FANN_GAUSSIAN:
+		return exp(-x * x);
+	case FANN_GAUSSIAN_SYMMETRIC:
+		return 2 * exp(-x * x) - 1;
+	case FANN_ELLIOT:
+		return x / 2 / (1 + fabs(x)) + (fann_type)0.5;
+	case FANN_ELLIOT_SYMMETRIC:
+		return x / (1 + fabs(x));
+	case FANN_LINEAR_PIECE:
+		return x < 0 ? 0 : x > 1 ? 1 : x;
+	case FANN_LINEAR_PIECE_SYMMETRIC:
+		return x < -1 ? -1 : x > 1 ? 1 : x;
+	default:
+		return x;
+	}
+}
+
+/*
+ * Derivative of the activation with respect to the weighted sum, given
+ * x = steepness * sum and y = the activation of x
+ */
+static fann_type ann_dense_derivative(enum fann_activationfunc_enum fun, fann_type s, fann_type x, fann_type y)
+{
+	switch(fun)
+	{
+	case FANN_SIGMOID:
+	case FANN_SIGMOID_STEPWISE:
+		return 2 * s * y * (1 - y);
+	case FANN_SIGMOID_SYMMETRIC:
+	case FANN_SIGMOID_SYMMETRIC_STEPWISE:
+		return s * (1 - y * y);
+	case FANN_GAUSSIAN:
+		return -2 * s * x * y;
+	case FANN_GAUSSIAN_SYMMETRIC:
+		return -2 * s * x * (y + 1);
+	case FANN_ELLIOT:
+		return s / (2 * (1 + fabs(x)) * (1 + fabs(x)));
+	case FANN_ELLIOT_SYMMETRIC:
+		return s / ((1 + fabs(x)) * (1 + fabs(x)));
+	default:
+		/* Linear, and linear piece like fann_activation_derived() */
+		return s;
+	}
+}
+
+/*
+ * Checks that ann is a fully connected layered network this trainer can
+ * handle. Returns an error message or NULL.
+ */
+static const char *ann_dense_check(struct fann *ann)
+{
+	struct fann_layer *layer;
+	struct fann_neuron *neuron, *prev;
+	unsigned int nprev, k;
+
+	if(fann_get_network_type(ann) != FANN_NETTYPE_LAYER || fann_get_connection_rate(ann) < 1)
+		return "mini-batch training needs a network created by fann.create_standard()";
+
+	for(layer = ann->first_layer + 1; layer != ann->last_layer; layer++)
+	{
+		prev = (layer - 1)->first_neuron;
+		nprev = (layer - 1)->last_neuron - prev;
+		for(neuron = layer->first_neuron; neuron != layer->last_neuron - 1; neuron++)
+		{
+			if(neuron->last_con - neuron->first_con != nprev)
+				return "mini-batch training needs a fully connected network";
+			for(k = 0; k < nprev; k++)
+				if(ann->connections[neuron->first_con + k] != prev + k)
+					return "mini-batch training needs a fully connected network";
+			if(!ann_dense_supported(neuron->activation_function))
+				return "activation function not supported by mini-batch training";
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Forward pass of rows samples through the dense layers
+ */
+static void ann_dense_forward(struct ann_dense *layers, unsigned int nlayers, const fann_type *input, unsigned int rows)
+{
+	struct ann_dense *d;
+	const fann_type *prev = input;
+	fann_type x, *sum, *out;
+	unsigned int l, r, j;
+
+	for(l = 0; l < nlayers; l++)
+	{
+		d = &layers[l];
+		ann_gemm_nt(rows, d->nout, d->nin + 1, prev, d->nin + 1, d->w, d->nin + 1, d->sum, d->nout);
+
+		for(r = 0; r < rows; r++)
+		{
+			sum = d->sum + (size_t)r*d->nout;
+			out = d->out + (size_t)r*(d->nout + 1);
+			for(j = 0; j < d->nout; j++)
+			{
+				/* Same clipping as fann_run() */
+				x = d->steepness[j] * sum[j];
+				if(x > 150)
+					x = 150;
+				else if(x < -150)
+					x = -150;
+				sum[j] = x;
+				out[j] = ann_dense_activation(d->fun[j], x);
+			}
+			out[d->nout] = 1;
+		}
+
+		prev = d->out;
+	}
+}
+
+/*
+ * Backward pass: computes the mean gradient of the squared error over the
+ * batch into every layer's g. Adds the batch's squared errors, measured like
+ * fann_test() does, to *mse and its bit fails to *bit_fail.
+ */
+static void ann_dense_backward(struct ann_dense *layers, unsigned int nlayers, const fann_type *input,
+							   const fann_type *target, unsigned int rows, const int *symmetric,
+							   fann_type bit_fail_limit, double *mse, unsigned int *bit_fail)
+{
+	struct ann_dense *d = &layers[nlayers - 1], *p;
+	const fann_type *prev;
+	fann_type diff, *out, *delta, *sum;
+	unsigned int l, r, j, n;
+
+	for(r = 0; r < rows; r++)
+	{
+		out = d->out + (size_t)r*(d->nout + 1);
+		sum = d->sum + (size_t)r*d->nout;
+		delta = d->delta + (size_t)r*d->nout;
+		for(j = 0; j < d->nout; j++)
+		{
+			diff = out[j] - target[(size_t)r*d->nout + j];
+			delta[j] = diff * ann_dense_derivative(d->fun[j], d->steepness[j], sum[j], out[j]);
+
+			if(symmetric[j])
+				diff /= 2;
+			*mse += (double)diff * diff;
+			if(diff >= bit_fail_limit || -diff >= bit_fail_limit)
+				(*bit_fail)++;
+		}
+	}
+
+	for(l = nlayers; l-- > 0; )
+	{
+		d = &layers[l];
+		prev = l ? layers[l - 1].out : input;
+
+		ann_gemm_tn(d->nout, d->nin + 1, rows, d->delta, d->nout, prev, d->nin + 1, d->g, d->nin + 1);
+		n = d->nout*(d->nin + 1);
+		for(j = 0; j < n; j++)
+			d->g[j] /= rows;
+
+		if(!l)
+			break;
+
+		/* Propagate to the previous layer, leaving out the bias column */
+		p = &layers[l - 1];
+		ann_gemm_nn(rows, d->nin, d->nout, d->delta, d->nout, d->w, d->nin + 1, p->delta, p->nout);
+		for(r = 0; r < rows; r++)
+		{
+			out = p->out + (size_t)r*(p->nout + 1);
+			sum = p->sum + (size_t)r*p->nout;
+			delta = p->delta + (size_t)r*p->nout;
+			for(j = 0; j < p->nout; j++)
+				delta[j] *= ann_dense_derivative(p->fun[j], p->steepness[j], sum[j], out[j]);
+		}
+	}
+}
+
+struct ann_minibatch_options
+{
+	unsigned int batch;
+	int adam, shuffle;
+	fann_type learning_rate, momentum, beta1, beta2, epsilon;
+};
+
+static void ann_dense_update(struct ann_dense *layers, unsigned int nlayers,
+							 const struct ann_minibatch_options *o, unsigned long step)
+{
+	struct ann_dense *d;
+	unsigned int l, i, n;
+	fann_type c1 = 1, c2 = 1, mhat, vhat;
+
+	if(o->adam)
+	{
+		c1 = 1 - pow(o->beta1, step);
+		c2 = 1 - pow(o->beta2, step);
+	}
+
+	for(l = 0; l < nlayers; l++)
+	{
+		d = &layers[l];
+		n = d->nout*(d->nin + 1);
+		if(o->adam)
+		{
+			for(i = 0; i < n; i++)
+			{
+				d->m[i] = o->beta1 * d->m[i] + (1 - o->beta1) * d->g[i];
+				d->v[i] = o->beta2 * d->v[i] + (1 - o->beta2) * d->g[i] * d->g[i];
+				mhat = d->m[i] / c1;
+				vhat = d->v[i] / c2;
+				d->w[i] -= o->learning_rate * mhat / (sqrt(vhat) + o->epsilon);
+			}
+		}
+		else
+		{
+			for(i = 0; i < n; i++)
+			{
+				d->m[i] = o->momentum * d->m[i] - o->learning_rate * d->g[i];
+				d->w[i] += d->m[i];
+			}
+		}
+	}
+}
+
+/*! ann:train_minibatch(train, max_epochs, desired_error, [options])
+ *# Trains the network on the data in {{train}} with mini-batch gradient
+ *# descent on the mean squared error, for up to {{max_epochs}} epochs or
+ *# until the error reaches {{desired_error}} (measured like
+ *# {{ann:train_on_data()}} does, honouring the train stop function).
+ *# Returns the number of epochs trained and the MSE of the last epoch.\n
+ *# The network must have been created by {{fann.create_standard()}}.
+ *# {{options}} is a table with these optional fields:
+ *{
+ ** {{optimizer}}: {{"adam"}} (default) or {{"sgd"}} for SGD with momentum
+ ** {{batch}}: samples per mini-batch, 32 by default
+ ** {{learning_rate}}: 0.001 for Adam, the network's learning rate for SGD
+ ** {{momentum}}: SGD momentum, the network's learning momentum by default
+ ** {{beta1}}, {{beta2}}, {{epsilon}}: Adam's parameters, by default 0.9,
+ *# 0.999 and 1e-8
+ ** {{shuffle}}: whether to visit the samples in a new random order every
+ *# epoch, true by default
+ *}
+ *x ann:train_minibatch(train, 1000, 0.001, {optimizer = "adam", batch = 64})
+ *-
+ */
+static int ann_train_minibatch(lua_State *L)
+{
+	static const char *const optimizers[] = {"adam", "sgd", NULL};
+	struct fann **ann;
+	struct fann_train_data **train;
+	struct ann_minibatch_options o;
+	struct ann_dense *layers, *d;
+	struct fann_layer *layer;
+	struct fann_neuron *neuron;
+	const char *err;
+	size_t size;
+	char *base, *p;
+	fann_type *input, *target;
+	unsigned int *order, nlayers, nin, nout, rows, max_epochs, epoch, start, count, r, j, t, bit_fail;
+	unsigned long step = 0;
+	int *symmetric, stop_bit;
+	float desired_error;
+	double mse = 0;
+	lua_Number batch;
+	lua_Integer n;
+
+	if(lua_gettop(L) < 4)
+		luaL_error(L, "insufficient parameters");
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	train = luaL_checkudata(L, 2, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 2, "'training data' expected");
+
+	n = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, n >= 1 && n <= UINT_MAX, 3, "max_epochs must be positive");
+	max_epochs = n;
+	desired_error = luaL_checknumber(L, 4);
+
+	memset(&o, 0, sizeof o);
+	o.adam = 1;
+	o.shuffle = 1;
+	if(!lua_isnoneornil(L, 5))
+	{
+		luaL_checktype(L, 5, LUA_TTABLE);
+		lua_getfield(L, 5, "optimizer");
+		o.adam = luaL_checkoption(L, -1, "adam", optimizers) == 0;
+		lua_pop(L, 1);
+		lua_getfield(L, 5, "shuffle");
+		if(!lua_isnil(L, -1))
+			o.shuffle = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	batch = ann_optnumber(L, 5, "batch", 32);
+	o.learning_rate = ann_optnumber(L, 5, "learning_rate", o.adam ? 0.001 : fann_get_learning_rate(*ann));
+	o.momentum = ann_optnumber(L, 5, "momentum", fann_get_learning_momentum(*ann));
+	o.beta1 = ann_optnumber(L, 5, "beta1", 0.9);
+	o.beta2 = ann_optnumber(L, 5, "beta2", 0.999);
+	o.epsilon = ann_optnumber(L, 5, "epsilon", 1e-8);
+	if(!(batch >= 1 && batch <= UINT_MAX))
+		luaL_error(L, "batch size must be positive");
+	o.batch = batch;
+
+	if((err = ann_dense_check(*ann)))
+		luaL_error(L, "%s", err);
+
+	nin = fann_get_num_input(*ann);
+	nout = fann_get_num_output(*ann);
+	rows = (*train)->num_data;
+	if((*train)->num_input != nin || (*train)->num_output != nout)
+		luaL_error(L, "training data does not match the network");
+	if(rows < 1)
+		luaL_error(L, "training data is empty");
+	if(o.batch > rows)
+		o.batch = rows;
+
+	nlayers = (*ann)->last_layer - (*ann)->first_layer - 1;
+	layers = lua_newuserdata(L, nlayers*(sizeof *layers));
+
+	/* One block for every matrix: weights, gradients and optimizer state,
+	 * per-neuron parameters, and the activations of a batch */
+	size = (size_t)o.batch*(nin + 1 + nout)*sizeof(fann_type) + rows*sizeof(unsigned int)
+		+ nout*sizeof(int);
+	for(layer = (*ann)->first_layer + 1, j = 0; layer != (*ann)->last_layer; layer++, j++)
+	{
+		d = &layers[j];
+		d->nin = (layer - 1)->last_neuron - (layer - 1)->first_neuron - 1;
+		d->nout = layer->last_neuron - layer->first_neuron - 1;
+		d->neurons = layer->first_neuron;
+		size += (size_t)4*d->nout*(d->nin + 1)*sizeof(fann_type)
+			+ d->nout*(sizeof(fann_type) + sizeof(enum fann_activationfunc_enum))
+			+ (size_t)o.batch*(3*d->nout + 1)*sizeof(fann_type);
+	}
+
+	base = p = calloc(1, size);
+	if(!base)
+		luaL_error(L, "out of memory");
+
+	/* fann_type arrays first, so that every array stays aligned */
+#define ANN_TAKE(ptr, n) (ptr = (void *)p, p += (size_t)(n)*sizeof *(ptr))
+	ANN_TAKE(input, o.batch*(nin + 1));
+	ANN_TAKE(target, o.batch*nout);
+	for(j = 0; j < nlayers; j++)
+	{
+		d = &layers[j];
+		t = d->nout*(d->nin + 1);
+		ANN_TAKE(d->w, t);
+		ANN_TAKE(d->g, t);
+		ANN_TAKE(d->m, t);
+		ANN_TAKE(d->v, t);
+		ANN_TAKE(d->steepness, d->nout);
+		ANN_TAKE(d->sum, o.batch*d->nout);
+		ANN_TAKE(d->out, o.batch*(d->nout + 1));
+		ANN_TAKE(d->delta, o.batch*d->nout);
+	}
+	for(j = 0; j < nlayers; j++)
+		ANN_TAKE(layers[j].fun, layers[j].nout);
+	ANN_TAKE(order, rows);
+	ANN_TAKE(symmetric, nout);
+#undef ANN_TAKE
+
+	for(j = 0; j < nlayers; j++)
+	{
+		d = &layers[j];
+		for(neuron = d->neurons, r = 0; r < d->nout; neuron++, r++)
+		{
+			memcpy(d->w + (size_t)r*(d->nin + 1), (*ann)->weights + neuron->first_con,
+				   (d->nin + 1)*sizeof(fann_type));
+			d->steepness[r] = neuron->activation_steepness;
+			d->fun[r] = neuron->activation_function;
+		}
+	}
+
+	for(j = 0; j < nout; j++)
+		symmetric[j] = ann_is_symmetric(layers[nlayers - 1].fun[j]);
+	for(r = 0; r < rows; r++)
+		order[r] = r;
+	stop_bit = fann_get_train_stop_function(*ann) == FANN_STOPFUNC_BIT;
+
+#ifdef FANN_VERBOSE
+	printf("Mini-batch training for up to %d epochs, batch %d\n", max_epochs, o.batch);
+#endif
+
+	for(epoch = 0; epoch < max_epochs; )
+	{
+		if(o.shuffle)
+		{
+			for(r = rows - 1; r > 0; r--)
+			{
+				j = rand() % (r + 1);
+				t = order[r];
+				order[r] = order[j];
+				order[j] = t;
+			}
+		}
+
+		mse = 0;
+		bit_fail = 0;
+		for(start = 0; start < rows; start += count)
+		{
+			count = rows - start < o.batch ? rows - start : o.batch;
+			for(r = 0; r < count; r++)
+			{
+				memcpy(input + (size_t)r*(nin + 1), (*train)->input[order[start + r]], nin*sizeof(fann_type));
+				input[(size_t)r*(nin + 1) + nin] = 1;
+				memcpy(target + (size_t)r*nout, (*train)->output[order[start + r]], nout*sizeof(fann_type));
+			}
+
+			ann_dense_forward(layers, nlayers, input, count);
+			ann_dense_backward(layers, nlayers, input, target, count, symmetric,
+							   fann_get_bit_fail_limit(*ann), &mse, &bit_fail);
+			ann_dense_update(layers, nlayers, &o, ++step);
+		}
+
+		epoch++;
+		mse /= (double)rows*nout;
+		if(stop_bit ? bit_fail <= (unsigned int)desired_error : mse <= desired_error)
+			break;
+	}
+
+	for(j = 0; j < nlayers; j++)
+	{
+		d = &layers[j];
+		for(neuron = d->neurons, r = 0; r < d->nout; neuron++, r++)
+			memcpy((*ann)->weights + neuron->first_con, d->w + (size_t)r*(d->nin + 1),
+				   (d->nin + 1)*sizeof(fann_type));
+	}
+	free(base);
+
+	lua_pushinteger(L, epoch);
+	lua_pushnumber(L, mse);
+	return 2;
+}
+
+/******************************************************************************
+*h Sampled Training
+*# Most samples of a large training set are learnt after a few epochs, yet
+*# every epoch of {{ann:train_on_data()}} visits all of them. Sampled
+*# training keeps the error each sample had when last seen, and draws the
+*# samples of later epochs with probability in proportion to it, so that
+*# the hard samples are trained on most.
+******************************************************************************/
+
+/*
+ * Trains ann on sample r of train, or only tests it unless learn is set,
+ * and returns the sample's error before the update
+ */
+static double ann_sample_error(struct fann *ann, struct fann_train_data *train, unsigned int r, int learn)
+{
+	fann_reset_MSE(ann);
+	if(learn)
+		fann_train(ann, train->input[r], train->output[r]);
+	else
+		fann_test(ann, train->input[r], train->output[r]);
+	return fann_get_MSE(ann);
+}
+
+/*
+ * Returns the next number in [0, 1) of the xorshift generator with state x,
+ * which must not be 0
+ */
+static double ann_xorshift(uint32_t *x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+	return *x / 4294967296.0;
+}
+
+/*! ann:train_sampled(train, max_epochs, desired_error, [options])
+ *# Trains the network incrementally on the data in {{train}}, for up to
+ *# {{max_epochs}} epochs or until the MSE reaches {{desired_error}}. The
+ *# first epoch visits every sample once; every later one draws samples at
+ *# random with probability in proportion to their last error. When the
+ *# last errors of the samples show the MSE at {{desired_error}} or below, a
+ *# pass testing every sample confirms it. Returns the number of epochs, the
+ *# MSE (from the last error of every sample if not confirmed) and the
+ *# number of samples evaluated.\n
+ *# {{options}} is a table with these optional fields:
+ *{
+ ** {{floor}}: the share of the draws made uniformly instead, so that easy
+ *# samples keep being seen, 0.1 by default
+ ** {{fraction}}: the samples drawn per epoch, as a fraction of the number
+ *# of samples, 1 by default
+ ** {{seed}}: a positive integer seeding the draws, so that runs can be
+ *# repeated; taken from the clock by default
+ *}
+ *x epochs, mse, evaluations = ann:train_sampled(train, 1000, 0.001, {floor = 0.2})
+ *-
+ */
+static int ann_train_sampled(lua_State *L)
+{
+	struct fann **ann;
+	struct fann_train_data **train;
+	unsigned int rows, draws, max_epochs, epoch, i, r, lo, hi;
+	double uniform, fraction, *error, *cumulative, sum, total, u, evaluations, seed;
+	float desired_error;
+	lua_Integer n;
+	uint32_t state;
+	struct timespec now;
+
+	if(lua_gettop(L) < 4)
+		luaL_error(L, "insufficient parameters");
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	train = luaL_checkudata(L, 2, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 2, "'training data' expected");
+
+	n = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, n >= 1 && n <= UINT_MAX, 3, "max_epochs must be positive");
+	max_epochs = n;
+	desired_error = luaL_checknumber(L, 4);
+	uniform = ann_optnumber(L, 5, "floor", 0.1);
+	fraction = ann_optnumber(L, 5, "fraction", 1);
+	luaL_argcheck(L, uniform >= 0 && uniform <= 1, 5, "floor must be between 0 and 1");
+	seed = ann_optnumber(L, 5, "seed", 0);
+	luaL_argcheck(L, fraction > 0, 5, "fraction must be positive");
+	luaL_argcheck(L, seed >= 0 && seed <= UINT32_MAX, 5, "seed must be a positive integer");
+
+	state = (uint32_t)seed;
+	if(!state)
+	{
+		clock_gettime(CLOCK_REALTIME, &now);
+		state = (uint32_t)now.tv_sec ^ (uint32_t)now.tv_nsec;
+		if(!state)
+			state = 1;
+	}
+
+	rows = (*train)->num_data;
+	if((*train)->num_input != fann_get_num_input(*ann) || (*train)->num_output != fann_get_num_output(*ann))
+		luaL_error(L, "training data does not match the network");
+	if(rows < 1)
+		luaL_error(L, "training data is empty");
+	draws = fraction*rows < 1 ? 1 : fraction*rows;
+
+#ifdef FANN_VERBOSE
+	printf("Sampled training: %d of %d samples per epoch\n", draws, rows);
+#endif
+
+	error = lua_newuserdata(L, 2*(size_t)rows*sizeof *error);
+	cumulative = error + rows;
+
+	sum = 0;
+	for(r = 0; r < rows; r++)
+		sum += error[r] = ann_sample_error(*ann, *train, r, 1);
+	evaluations = rows;
+
+	for(epoch = 1; epoch < max_epochs && sum / rows > desired_error; epoch++)
+	{
+		/* Draw sample r with probability uniform/rows + (1 - uniform)*error[r]/sum */
+		total = 0;
+		for(r = 0; r < rows; r++)
+		{
+			total += uniform / rows + (1 - uniform)*(sum > 0 ? error[r] / sum : 1.0 / rows);
+			cumulative[r] = total;
+		}
+
+		for(i = 0; i < draws; i++)
+		{
+			u = ann_xorshift(&state)*total;
+			for(lo = 0, hi = rows - 1; lo < hi; )
+			{
+				r = lo + (hi - lo) / 2;
+				if(cumulative[r] > u)
+					hi = r;
+				else
+					lo = r + 1;
+			}
+			error[lo] = ann_sample_error(*ann, *train, lo, 1);
+		}
+		evaluations += draws;
+
+		sum = 0;
+		for(r = 0; r < rows; r++)
+			sum += error[r];
+
+		/* Only a full pass tells whether the MSE is reached */
+		if(sum / rows <= desired_error)
+		{
+			sum = 0;
+			for(r = 0; r < rows; r++)
+				sum += error[r] = ann_sample_error(*ann, *train, r, 0);
+			evaluations += rows;
+		}
+	}
+
+	lua_pushinteger(L, epoch);
+	lua_pushnumber(L, sum / rows);
+	lua_pushnumber(L, evaluations);
+	return 3;
+}
+
+/******************************************************************************
+*h Training Generators
+*# A training generator produces training data batch by batch while the
+*# network trains, instead of materializing it all as training data first.
+*# Batches are produced into a ring of buffers: while the network trains on
+*# one batch, the next ones are being prepared. Producers are Lua functions,
+*# or C functions registered with {{luafann_register_producer()}} (see
+*# fann.h), which run on a thread of their own.
+******************************************************************************/
+
+struct ann_producer
+{
+	struct ann_producer *next;
+	char *name;
+	luafann_producer fn;
+	void *ud;
+};
+
+static pthread_mutex_t ann_producer_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ann_producer *ann_producers;
+
+LUALIB_API int luafann_register_producer(const char *name, luafann_producer fn, void *ud)
+{
+	struct ann_producer **it, *p;
+	int ret = 0;
+
+	pthread_mutex_lock(&ann_producer_lock);
+	for(it = &ann_producers; *it; it = &(*it)->next)
+		if(!strcmp((*it)->name, name))
+			break;
+
+	if(!fn)
+	{
+		if((p = *it))
+		{
+			*it = p->next;
+			free(p->name);
+			free(p);
+		}
+	}
+	else if((p = *it))
+	{
+		p->fn = fn;
+		p->ud = ud;
+	}
+	else if((p = calloc(1, sizeof *p)) && (p->name = malloc(strlen(name) + 1)))
+	{
+		strcpy(p->name, name);
+		p->fn = fn;
+		p->ud = ud;
+		*it = p;
+	}
+	else
+	{
+		free(p);
+		ret = -1;
+	}
+	pthread_mutex_unlock(&ann_producer_lock);
+
+	return ret;
+}
+
+struct ann_generator
+{
+	luafann_producer fn;	/* C producer, or NULL */
+	void *ud;
+	int ref;				/* Lua producer */
+	unsigned int rows, prefetch;
+};
+
+/*
+ * State shared by the producing and the training side of one
+ * ann:train_on_generator() call
+ */
+struct ann_generator_run
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	lua_State *L;
+	struct ann_generator *gen;
+	struct fann *ann;
+	struct fann_train_data *buffers;
+	unsigned long produced, consumed, max_batches;
+	int eof, stop, failed, has_desired_error;
+	float desired_error, mse;
+};
+
+/*
+ * Calls the Lua producer and copies the rows it returns into the training
+ * data passed as a light userdata. Run through lua_pcall().
+ */
+static int ann_generator_fill_lua(lua_State *L)
+{
+	struct ann_generator *gen = lua_touserdata(L, 1);
+	struct fann_train_data *data = lua_touserdata(L, 2);
+	unsigned int rows, i;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, gen->ref);
+	lua_pushinteger(L, gen->rows);
+	lua_call(L, 1, 2);
+
+	data->num_data = 0;
+	if(lua_isnil(L, -2))
+		return 0;
+
+	luaL_checktype(L, -2, LUA_TTABLE);
+	luaL_checktype(L, -1, LUA_TTABLE);
+	rows = lua_rawlen(L, -2);
+	if(rows != lua_rawlen(L, -1))
+		luaL_error(L, "producer returned %d input rows but %d output rows", rows, (int)lua_rawlen(L, -1));
+	if(rows > gen->rows)
+		luaL_error(L, "producer returned %d rows, at most %d expected", rows, gen->rows);
+
+	for(i = 0; i < rows; i++)
+	{
+		lua_rawgeti(L, -2, i + 1);
+		ann_checkvector(L, -1, "inputs", data->num_input, data->input[i], 1);
+		lua_pop(L, 1);
+
+		lua_rawgeti(L, -1, i + 1);
+		ann_checkvector(L, -1, "outputs", data->num_output, data->output[i], 1);
+		lua_pop(L, 1);
+	}
+	data->num_data = rows;
+
+	return 0;
+}
+
+/*
+ * Produces the next batch into data. Returns non-zero on failure, leaving
+ * the error message of a Lua producer on the stack.
+ */
+static int ann_generator_fill(struct ann_generator_run *run, struct fann_train_data *data)
+{
+	struct luafann_batch batch;
+
+	if(run->gen->fn)
+	{
+		batch.rows = run->gen->rows;
+		batch.num_input = data->num_input;
+		batch.num_output = data->num_output;
+		batch.type_size = sizeof(fann_type);
+		batch.input = data->input[0];
+		batch.output = data->output[0];
+		data->num_data = run->gen->fn(run->gen->ud, &batch);
+		if(data->num_data > run->gen->rows)
+			data->num_data = run->gen->rows;
+		return 0;
+	}
+
+	lua_pushcfunction(run->L, ann_generator_fill_lua);
+	lua_pushlightuserdata(run->L, run->gen);
+	lua_pushlightuserdata(run->L, data);
+	return lua_pcall(run->L, 2, 0, 0) != 0;
+}
+
+/*
+ * Fills free buffers until the data ends, max_batches are produced or the
+ * training side stops
+ */
+static void *ann_generator_produce(void *arg)
+{
+	struct ann_generator_run *run = arg;
+	struct fann_train_data *data;
+	int failed;
+
+	pthread_mutex_lock(&run->lock);
+	for(;;)
+	{
+		while(!run->stop && run->produced - run->consumed == run->gen->prefetch)
+			pthread_cond_wait(&run->cond, &run->lock);
+		if(run->stop || run->produced == run->max_batches)
+			break;
+		data = &run->buffers[run->produced % run->gen->prefetch];
+		pthread_mutex_unlock(&run->lock);
+
+		failed = ann_generator_fill(run, data);
+
+		pthread_mutex_lock(&run->lock);
+		if(failed || !data->num_data)
+		{
+			run->failed = failed;
+			break;
+		}
+		run->produced++;
+		pthread_cond_signal(&run->cond);
+	}
+	run->eof = 1;
+	pthread_cond_signal(&run->cond);
+	pthread_mutex_unlock(&run->lock);
+
+	return NULL;
+}
+
+/*
+ * Trains on the produced buffers until they run out or training stops
+ */
+static void *ann_generator_train(void *arg)
+{
+	struct ann_generator_run *run = arg;
+	struct fann_train_data *data;
+	float mse;
+
+	pthread_mutex_lock(&run->lock);
+	for(;;)
+	{
+		while(!run->eof && run->consumed == run->produced)
+			pthread_cond_wait(&run->cond, &run->lock);
+		if(run->consumed == run->produced)
+			break;
+		data = &run->buffers[run->consumed % run->gen->prefetch];
+		pthread_mutex_unlock(&run->lock);
+
+		mse = fann_train_epoch(run->ann, data);
+
+		pthread_mutex_lock(&run->lock);
+		run->mse = mse;
+		run->consumed++;
+		if(run->consumed == run->max_batches
+		   || (run->has_desired_error && ann_desired_error_reached(run->ann, run->desired_error)))
+			break;
+		pthread_cond_signal(&run->cond);
+	}
+	run->stop = 1;
+	pthread_cond_signal(&run->cond);
+	pthread_mutex_unlock(&run->lock);
+
+	return NULL;
+}
+
+/*! fann.train_generator(producer, batch_rows, [options])
+ *# Creates a training generator producing batches of up to
+ *# {{batch_rows}} samples. {{producer}} is either the name of a registered
+ *# C producer, or a Lua function called as {{producer(batch_rows)}} that
+ *# returns a table of input rows and a table of output rows, like the
+ *# arguments of {{ann:train_batch()}}, or nil once the data is exhausted.
+ *# {{options.prefetch}} is the number of batch buffers (default and minimum
+ *# 2), i.e. how many batches may be produced ahead of training.
+ *x gen = fann.train_generator(function(n) return next_inputs(n), next_outputs(n) end, 64)
+ *-
+ */
+static int ann_generator_create(lua_State *L)
+{
+	struct ann_generator *gen;
+	struct ann_producer *p;
+	int rows, prefetch;
+	lua_Number n;
+
+	if(lua_type(L, 1) != LUA_TFUNCTION)
+		luaL_checkstring(L, 1);
+	rows = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, rows > 0, 2, "batch_rows must be positive");
+	n = ann_optnumber(L, 3, "prefetch", 2);
+	if(!(n <= INT_MAX))
+		luaL_error(L, "prefetch count out of range");
+	prefetch = n < 2 ? 2 : n;
+
+	gen = lua_newuserdata(L, sizeof *gen);
+	memset(gen, 0, sizeof *gen);
+	gen->ref = LUA_NOREF;
+	gen->rows = rows;
+	gen->prefetch = prefetch;
+	luaL_getmetatable(L, FANN_GENERATOR_METATABLE);
+	lua_setmetatable(L, -2);
+
+	if(lua_type(L, 1) == LUA_TFUNCTION)
+	{
+		lua_pushvalue(L, 1);
+		gen->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	else
+	{
+		pthread_mutex_lock(&ann_producer_lock);
+		for(p = ann_producers; p; p = p->next)
+			if(!strcmp(p->name, lua_tostring(L, 1)))
+				break;
+		if(p)
+		{
+			gen->fn = p->fn;
+			gen->ud = p->ud;
+		}
+		pthread_mutex_unlock(&ann_producer_lock);
+
+		if(!p)
+			luaL_error(L, "no producer registered as '%s'", lua_tostring(L, 1));
+	}
+
+	return 1;
+}
+
+/*! ann:train_on_generator(gen, max_batches, [desired_error])
+ *# Trains the network with {{fann_train_epoch()}} on each batch the
+ *# generator {{gen}} produces, producing the next batches in the meantime,
+ *# until {{max_batches}} batches are trained, the producer runs out of data
+ *# or the error of a batch reaches {{desired_error}}. Batches produced ahead
+ *# are dropped when training stops. Returns the number of batches trained
+ *# and the MSE of the last one.\n
+ *# A Lua producer runs on the calling thread while the network trains on
+ *# another, so it must not use the network.
+ *x batches, mse = ann:train_on_generator(gen, 10000, 0.001)
+ *-
+ */
+static int ann_train_on_generator(lua_State *L)
+{
+	struct fann **ann;
+	struct ann_generator *gen;
+	struct ann_generator_run run;
+	struct fann_train_data *data;
+	fann_type *buf, **rows;
+	size_t size;
+	pthread_t thread;
+	unsigned int nin, nout, i, r;
+	int started;
+	lua_Integer n;
+
+	if(lua_gettop(L) < 3)
+		luaL_error(L, "insufficient parameters");
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	gen = luaL_checkudata(L, 2, FANN_GENERATOR_METATABLE);
+	luaL_argcheck(L, gen != NULL, 2, "'training generator' expected");
+
+	memset(&run, 0, sizeof run);
+	run.L = L;
+	run.gen = gen;
+	run.ann = *ann;
+	n = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, n >= 1 && (unsigned long long)n <= ULONG_MAX, 3, "max_batches must be positive");
+	run.max_batches = n;
+	run.has_desired_error = !lua_isnoneornil(L, 4);
+	run.desired_error = luaL_optnumber(L, 4, 0);
+
+	nin = fann_get_num_input(*ann);
+	nout = fann_get_num_output(*ann);
+
+	/* All buffers live in one userdata, in case the producer raises an error */
+	size = gen->prefetch*(sizeof *run.buffers + 2*gen->rows*sizeof(fann_type *)
+						 + (size_t)gen->rows*(nin + nout)*sizeof(fann_type));
+	run.buffers = lua_newuserdata(L, size);
+	rows = (fann_type **)(run.buffers + gen->prefetch);
+	buf = (fann_type *)(rows + 2*gen->prefetch*gen->rows);
+	for(i = 0; i < gen->prefetch; i++)
+	{
+		data = &run.buffers[i];
+		memset(data, 0, sizeof *data);
+		data->num_input = nin;
+		data->num_output = nout;
+		data->input = rows;
+		data->output = rows + gen->rows;
+		rows += 2*gen->rows;
+		for(r = 0; r < gen->rows; r++)
+		{
+			data->input[r] = buf + r*nin;
+			data->output[r] = buf + gen->rows*nin + r*nout;
+		}
+		buf += (size_t)gen->rows*(nin + nout);
+	}
+
+#ifdef FANN_VERBOSE
+	printf("Training on a generator of %d-row batches with %d buffers\n", gen->rows, gen->prefetch);
+#endif
+
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_cond_init(&run.cond, NULL);
+
+	/* C producers run on the new thread, Lua producers on the calling one */
+	if(gen->fn)
+	{
+		started = !pthread_create(&thread, NULL, ann_generator_produce, &run);
+		if(started)
+			ann_generator_train(&run);
+	}
+	else
+	{
+		started = !pthread_create(&thread, NULL, ann_generator_train, &run);
+		if(started)
+			ann_generator_produce(&run);
+	}
+	if(started)
+		pthread_join(thread, NULL);
+
+	pthread_cond_destroy(&run.cond);
+	pthread_mutex_destroy(&run.lock);
+
+	if(!started)
+		luaL_error(L, "Unable to start generator thread");
+	if(run.failed)
+		lua_error(L);
+
+	lua_pushinteger(L, run.consumed);
+	lua_pushnumber(L, run.mse);
+	return 2;
+}
+
+/*! gen:__gc()
+ *# Releases the producer of a training generator
+ *-
+ */
+static int ann_generator_gc(lua_State *L)
+{
+	struct ann_generator *gen;
+
+	gen = luaL_checkudata(L, 1, FANN_GENERATOR_METATABLE);
+	luaL_argcheck(L, gen != NULL, 1, "'training generator' expected");
+
+	luaL_unref(L, LUA_REGISTRYINDEX, gen->ref);
+	gen->ref = LUA_NOREF;
+	return 0;
+}
+
+/*! gen:__tostring()
+ *# Converts a training generator to a string for Lua's virtual machine
+ *x print(gen)
+ *-
+ */
+static int ann_generator_tostring(lua_State *L)
+{
+	struct ann_generator *gen;
+
+	gen = luaL_checkudata(L, 1, FANN_GENERATOR_METATABLE);
+	luaL_argcheck(L, gen != NULL, 1, "'training generator' expected");
+
+	lua_pushfstring(L, "[[FANN training generator: %s %d %d]]", gen->fn ? "C" : "Lua",
+					gen->rows, gen->prefetch);
+	return 1;
+}
+#endif
+
+/******************************************************************************
+*h Inference Queues
+*# An inference queue collects single-sample requests for a network and
+*# evaluates them in micro-batches on native worker threads. Each worker
+*# owns a private copy of the network, so the queue does not see changes
+*# made to {{ann}} after the queue was created.
+******************************************************************************/
+
+struct ann_request
+{
+	struct ann_request *next;
+	lua_State *co;			/* waiting coroutine, NULL when the caller blocks */
+	int ref;				/* registry reference keeping co alive */
+	int finished;
+	struct timespec queued;
+	fann_type *input, *output;
+};
+
+struct ann_queue_worker
+{
+	struct ann_queue *q;
+	struct fann *ann;
+	pthread_t thread;
+};
+
+struct ann_queue
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* new requests or shutdown */
+	pthread_cond_t done;	/* a micro-batch was evaluated */
+	struct ann_request *pending, **pending_tail;
+	struct ann_request *finished, **finished_tail;
+	unsigned int num_pending, num_busy;
+	unsigned int nin, nout, max_batch;
+	unsigned int multiplier;	/* of the network's fixed point values */
+	long max_wait;
+	int nthreads, closing;
+	struct ann_queue_worker *workers;
+};
+
+/*
+ * Sets ts to from + us microseconds
+ */
+static void ann_deadline(struct timespec *ts, const struct timespec *from, long us)
+{
+	ts->tv_sec = from->tv_sec + us / 1000000;
+	ts->tv_nsec = from->tv_nsec + (us % 1000000) * 1000;
+	if(ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * Worker thread: waits until max_batch requests are pending or the oldest
+ * one has waited max_wait microseconds, then evaluates them as one batch.
+ */
+static void *ann_queue_worker(void *arg)
+{
+	struct ann_queue_worker *w = arg;
+	struct ann_queue *q = w->q;
+	struct ann_request *batch, *req, **tail;
+	struct timespec deadline;
+	unsigned int n;
+	fann_type *output;
+
+	pthread_mutex_lock(&q->lock);
+	while(!q->closing || q->pending)
+	{
+		if(!q->pending)
+		{
+			pthread_cond_wait(&q->work, &q->lock);
+			continue;
+		}
+
+		if(q->num_pending < q->max_batch && !q->closing)
+		{
+			ann_deadline(&deadline, &q->pending->queued, q->max_wait);
+			if(pthread_cond_timedwait(&q->work, &q->lock, &deadline) != ETIMEDOUT || !q->pending)
+				continue;
+		}
+
+		batch = q->pending;
+		tail = &batch;
+		for(n = 0; *tail && n < q->max_batch; n++)
+			tail = &(*tail)->next;
+		q->pending = *tail;
+		if(!q->pending)
+			q->pending_tail = &q->pending;
+		*tail = NULL;
+		q->num_pending -= n;
+		q->num_busy += n;
+		pthread_mutex_unlock(&q->lock);
+
+		for(req = batch; req; req = req->next)
+		{
+			output = fann_run(w->ann, req->input);
+			memcpy(req->output, output, q->nout*(sizeof *output));
+		}
+
+		pthread_mutex_lock(&q->lock);
+		while(batch)
+		{
+			req = batch;
+			batch = req->next;
+			req->finished = 1;
+			if(req->co)
+			{
+				req->next = NULL;
+				*q->finished_tail = req;
+				q->finished_tail = &req->next;
+			}
+		}
+		q->num_busy -= n;
+		pthread_cond_broadcast(&q->done);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+/*
+ * Stops the worker threads and releases everything the queue holds.
+ * Coroutines still waiting on the queue are never resumed.
+ */
+static void ann_queue_shutdown(lua_State *L, struct ann_queue *q)
+{
+	struct ann_request *req, *lists[2];
+	int i;
+
+	if(!q->workers)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	q->closing = 1;
+	pthread_cond_broadcast(&q->work);
+	pthread_mutex_unlock(&q->lock);
+
+	for(i = 0; i < q->nthreads; i++)
+	{
+		pthread_join(q->workers[i].thread, NULL);
+		fann_destroy(q->workers[i].ann);
+	}
+	free(q->workers);
+	q->workers = NULL;
+
+	lists[0] = q->pending;
+	lists[1] = q->finished;
+	for(i = 0; i < 2; i++)
+	{
+		while(lists[i])
+		{
+			req = lists[i];
+			lists[i] = req->next;
+			luaL_unref(L, LUA_REGISTRYINDEX, req->ref);
+			free(req);
+		}
+	}
+	q->pending = q->finished = NULL;
+
+	pthread_cond_destroy(&q->work);
+	pthread_cond_destroy(&q->done);
+	pthread_mutex_destroy(&q->lock);
+}
+
+/*! ann:queue([max_batch, [max_wait, [threads]]])
+ *# Creates an inference queue for the network.\n
+ *# Pending requests are evaluated in micro-batches of up to {{max_batch}}
+ *# samples (default 32); a partial batch is started once its oldest request
+ *# has waited {{max_wait}} microseconds (default 1000). {{threads}} worker
+ *# threads (default 1) each evaluate their own copy of the network.
+ *x q = ann:queue(64, 500, 4)
+ *-
+ */
+static int ann_queue_create(lua_State *L)
+{
+	struct fann **ann;
+	struct ann_queue *q;
+	int max_batch, max_wait, nthreads, i;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	max_batch = luaL_optinteger(L, 2, 32);
+	max_wait = luaL_optinteger(L, 3, 1000);
+	nthreads = luaL_optinteger(L, 4, 1);
+
+	luaL_argcheck(L, max_batch > 0, 2, "batch size must be positive");
+	luaL_argcheck(L, max_wait >= 0, 3, "wait time must not be negative");
+	luaL_argcheck(L, nthreads > 0, 4, "at least one thread is needed");
+
+#ifdef FANN_VERBOSE
+	printf("Creating inference queue: batch %d, wait %dus, %d threads\n", max_batch, max_wait, nthreads);
+#endif
+
+	q = lua_newuserdata(L, sizeof *q);
+	memset(q, 0, sizeof *q);
+	q->pending_tail = &q->pending;
+	q->finished_tail = &q->finished;
+	q->nin = fann_get_num_input(*ann);
+	q->nout = fann_get_num_output(*ann);
+	q->max_batch = max_batch;
+	q->max_wait = max_wait;
+	q->multiplier = ann_multiplier(*ann);
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->work, NULL);
+	pthread_cond_init(&q->done, NULL);
+
+	q->workers = calloc(nthreads, sizeof *q->workers);
+	if(!q->workers)
+		luaL_error(L, "out of memory");
+
+	luaL_getmetatable(L, FANN_QUEUE_METATABLE);
+	lua_setmetatable(L, -2);
+
+	for(i = 0; i < nthreads; i++)
+	{
+		q->workers[i].q = q;
+		q->workers[i].ann = fann_copy(*ann);
+		if(!q->workers[i].ann
+		   || pthread_create(&q->workers[i].thread, NULL, ann_queue_worker, &q->workers[i]))
+		{
+			if(q->workers[i].ann)
+				fann_destroy(q->workers[i].ann);
+			q->nthreads = i;
+			ann_queue_shutdown(L, q);
+			luaL_error(L, "Unable to start inference queue worker %d", i);
+		}
+		q->nthreads = i + 1;
+	}
+
+	return 1;
+}
+
+/*
+ * Returns whether the running coroutine can yield. Lua 5.1 and 5.2 have no
+ * way to ask, so there any C function below the caller on the coroutine's
+ * stack, such as pcall, is taken to mean that it cannot.
+ */
+static int ann_yieldable(lua_State *L)
+{
+#if LUA_VERSION_NUM > 502
+	return lua_isyieldable(L);
+#else
+	lua_Debug ar;
+	int level, main;
+
+	main = lua_pushthread(L);
+	lua_pop(L, 1);
+	if(main)
+		return 0;
+
+	for(level = 1; lua_getstack(L, level, &ar); level++)
+	{
+		lua_getinfo(L, "S", &ar);
+		if(*ar.what == 'C')
+			return 0;
+	}
+	return 1;
+#endif
+}
+
+/*! q:run(input1, input2, ..., inputn)
+ *# Submits a sample to the queue and returns the network's outputs.\n
+ *# Called from a coroutine, it yields until {{q:poll()}} resumes the
+ *# coroutine with the outputs. Called from the main thread, or from a
+ *# coroutine that cannot yield (inside {{pcall()}} before Lua 5.3, say), it
+ *# blocks until the sample has been evaluated. A coroutine resumed by
+ *# anything else while it waits raises an error, and its sample is dropped.
+ *x local xor = q:run(-1, 1)
+ *-
+ */
+
+/*
+ * q:run() is this Lua function around ann_queue_submit(), so that the
+ * coroutine yields from Lua and sees how it is resumed on every version.
+ * The table parked maps each coroutine waiting on a queue to its request,
+ * which q:poll() passes back as the first value when it resumes it.
+ */
+static const char ann_queue_run_lua[] =
+	"local submit, parked = ...\n"
+	"local running, yield = coroutine.running, coroutine.yield\n"
+	"local function wake(req, token, ...)\n"
+	"	if token ~= req then\n"
+	"		parked[running()] = nil\n"
+	"		error('coroutine resumed while waiting on an inference queue', 0)\n"
+	"	end\n"
+	"	return ...\n"
+	"end\n"
+	"local function finish(req, ...)\n"
+	"	if req then return wake(req, yield()) end\n"
+	"	return ...\n"
+	"end\n"
+	"return function(q, ...) return finish(submit(q, ...)) end\n";
+
+/*
+ * Submits a sample to the queue. Returns the request, after marking the
+ * coroutine as parked on it, if the caller is to yield; otherwise waits for
+ * the outputs and returns false followed by them.
+ */
+static int ann_queue_submit(lua_State *L)
+{
+	struct ann_queue *q;
+	struct ann_request *req;
+	int nin, i, main;
+
+	q = luaL_checkudata(L, 1, FANN_QUEUE_METATABLE);
+	luaL_argcheck(L, q != NULL, 1, "'inference queue' expected");
+	if(!q->workers)
+		luaL_error(L, "inference queue is closed");
+
+	nin = lua_gettop(L) - 1;
+	if(nin != (int)q->nin)
+		luaL_error(L, "wrong number of inputs: expected %d, got %d", q->nin, nin);
+	for(i = 0; i < nin; i++)
+		luaL_checknumber(L, i + 2);
+
+	main = !ann_yieldable(L);
+
+	req = malloc(sizeof *req + (q->nin + q->nout)*sizeof(fann_type));
+	if(!req)
+		luaL_error(L, "out of memory");
+	req->next = NULL;
+	req->finished = 0;
+	req->input = (fann_type *)(req + 1);
+	req->output = req->input + q->nin;
+	for(i = 0; i < nin; i++)
+		req->input[i] = ann_tofann(q->multiplier, lua_tonumber(L, i + 2));
+
+	if(main)
+	{
+		req->co = NULL;
+		req->ref = LUA_NOREF;
+	}
+	else
+	{
+		lua_pushthread(L);
+		req->co = L;
+		req->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+		lua_getfield(L, LUA_REGISTRYINDEX, FANN_QUEUE_PARKED);
+		lua_pushthread(L);
+		lua_pushlightuserdata(L, req);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &req->queued);
+
+	pthread_mutex_lock(&q->lock);
+	*q->pending_tail = req;
+	q->pending_tail = &req->next;
+	q->num_pending++;
+	pthread_cond_signal(&q->work);
+
+	if(!main)
+	{
+		pthread_mutex_unlock(&q->lock);
+		lua_pushlightuserdata(L, req);
+		return 1;
+	}
+
+	while(!req->finished)
+		pthread_cond_wait(&q->done, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+
+	lua_settop(L, 0);
+	lua_checkstack(L, q->nout + 1);
+	lua_pushboolean(L, 0);
+	for(i = 0; i < (int)q->nout; i++)
+		lua_pushnumber(L, ann_fromfann(q->multiplier, req->output[i]));
+	free(req);
+
+	return q->nout + 1;
+}
+
+/*! q:poll([block])
+ *# Resumes every coroutine whose sample has been evaluated, passing it the
+ *# network's outputs, and returns the number of coroutines resumed.\n
+ *# If {{block}} is true, first waits until all submitted samples are done.
+ *x while q:pending() > 0 do q:poll(true) end
+ *-
+ */
+static int ann_queue_poll(lua_State *L)
+{
+	struct ann_queue *q;
+	struct ann_request *list, *req;
+	int resumed = 0, failed = 0, status, parked, waiting;
+	unsigned int i;
+
+	q = luaL_checkudata(L, 1, FANN_QUEUE_METATABLE);
+	luaL_argcheck(L, q != NULL, 1, "'inference queue' expected");
+	if(!q->workers)
+		luaL_error(L, "inference queue is closed");
+
+	pthread_mutex_lock(&q->lock);
+	if(lua_toboolean(L, 2))
+	{
+		while(q->num_pending || q->num_busy)
+			pthread_cond_wait(&q->done, &q->lock);
+	}
+	list = q->finished;
+	q->finished = NULL;
+	q->finished_tail = &q->finished;
+	pthread_mutex_unlock(&q->lock);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, FANN_QUEUE_PARKED);
+	waiting = lua_gettop(L);
+	while(list)
+	{
+		req = list;
+		list = req->next;
+
+		/* Only resume a coroutine still parked on this very request */
+		lua_pushthread(req->co);
+		lua_xmove(req->co, L, 1);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, waiting);
+		parked = lua_touserdata(L, -1) == req && lua_status(req->co) == LUA_YIELD;
+		lua_pop(L, 1);
+		if(!parked)
+		{
+			lua_pop(L, 1);
+			luaL_unref(L, LUA_REGISTRYINDEX, req->ref);
+			free(req);
+			continue;
+		}
+		lua_pushnil(L);
+		lua_rawset(L, waiting);
+
+		lua_checkstack(req->co, q->nout + 1);
+		lua_pushlightuserdata(req->co, req);
+		for(i = 0; i < q->nout; i++)
+			lua_pushnumber(req->co, ann_fromfann(q->multiplier, req->output[i]));
+
+		status = ann_resume(req->co, L, q->nout + 1);
+		if(status != 0 && status != LUA_YIELD && !failed)
+		{
+			lua_xmove(req->co, L, 1);
+			failed = 1;
+		}
+		if(status != LUA_YIELD)
+			lua_settop(req->co, 0);
+
+		luaL_unref(L, LUA_REGISTRYINDEX, req->ref);
+		free(req);
+		resumed++;
+	}
+
+	if(failed)
+		lua_error(L);
+
+	lua_pushinteger(L, resumed);
+	return 1;
+}
+
+/*! q:pending()
+ *# Returns the number of submitted samples that were not yet handed back
+ *# by {{q:poll()}}.
+ *-
+ */
+static int ann_queue_pending(lua_State *L)
+{
+	struct ann_queue *q;
+	struct ann_request *req;
+	int n;
+
+	q = luaL_checkudata(L, 1, FANN_QUEUE_METATABLE);
+	luaL_argcheck(L, q != NULL, 1, "'inference queue' expected");
+
+	if(!q->workers)
+	{
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	pthread_mutex_lock(&q->lock);
+	n = q->num_pending + q->num_busy;
+	for(req = q->finished; req; req = req->next)
+		n++;
+	pthread_mutex_unlock(&q->lock);
+
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+/*! q:close()
+ *# Stops the queue's worker threads. Coroutines still waiting on the queue
+ *# are not resumed. Also called when the queue is garbage collected.
+ *x q:close()
+ *-
+ */
+static int ann_queue_close(lua_State *L)
+{
+	struct ann_queue *q;
+
+	q = luaL_checkudata(L, 1, FANN_QUEUE_METATABLE);
+	luaL_argcheck(L, q != NULL, 1, "'inference queue' expected");
+
+#ifdef FANN_VERBOSE
+	printf("Closing inference queue\n");
+#endif
+
+	ann_queue_shutdown(L, q);
+	return 0;
+}
+
+/*! q:__tostring()
+ *# Converts an inference queue to a string for Lua's virtual machine
+ *x print(q)
+ *-
+ */
+static int ann_queue_tostring(lua_State *L)
+{
+	struct ann_queue *q;
+
+	q = luaL_checkudata(L, 1, FANN_QUEUE_METATABLE);
+	luaL_argcheck(L, q != NULL, 1, "'inference queue' expected");
+
+	lua_pushfstring(L, "[[FANN inference queue: %d %d %d]]", q->max_batch,
+					(int)q->max_wait, q->nthreads);
+	return 1;
+}
+
+/******************************************************************************
+*h Watched Models
+*# A watched model follows a network file on disk. A background thread
+*# checks the file periodically and, when it changes, loads the new network
+*# and swaps it in between two evaluations. The previous network is destroyed
+*# as soon as no evaluation uses it any more.
+******************************************************************************/
+
+struct ann_model_version
+{
+	struct fann *ann;
+	int refs;
+	unsigned int number;
+};
+
+struct ann_model
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	char *path;
+	long interval;			/* milliseconds between checks */
+	struct ann_model_version *current;
+	struct stat st;			/* the file as it was last loaded */
+	unsigned int reloads;
+	int closing, started;
+	pthread_t thread;
+};
+
+static struct ann_model_version *ann_model_acquire(struct ann_model *m)
+{
+	struct ann_model_version *v;
+
+	pthread_mutex_lock(&m->lock);
+	v = m->current;
+	v->refs++;
+	pthread_mutex_unlock(&m->lock);
+
+	return v;
+}
+
+static void ann_model_release(struct ann_model *m, struct ann_model_version *v)
+{
+	int retired;
+
+	pthread_mutex_lock(&m->lock);
+	retired = --v->refs == 0 && v != m->current;
+	pthread_mutex_unlock(&m->lock);
+
+	if(retired)
+	{
+		fann_destroy(v->ann);
+		free(v);
+	}
+}
+
+/*
+ * The nanoseconds of a file's modification time, so that a rewrite within
+ * the same second is seen. Where struct stat has st_mtim, st_mtime is a
+ * macro for its seconds; elsewhere only the seconds are compared.
+ */
+#ifdef st_mtime
+#define ann_mtime_nsec(st) ((st)->st_mtim.tv_nsec)
+#else
+#define ann_mtime_nsec(st) 0
+#endif
+
+static int ann_model_changed(const struct stat *a, const struct stat *b)
+{
+	return a->st_mtime != b->st_mtime || ann_mtime_nsec(a) != ann_mtime_nsec(b)
+		|| a->st_size != b->st_size || a->st_ino != b->st_ino || a->st_dev != b->st_dev;
+}
+
+/*
+ * Background thread: stat()s the file every interval milliseconds and
+ * swaps in a freshly loaded network whenever it has changed.
+ */
+static void *ann_model_watcher(void *arg)
+{
+	struct ann_model *m = arg;
+	struct ann_model_version *v, *old;
+	struct timespec now, deadline;
+	struct stat st;
+
+	pthread_mutex_lock(&m->lock);
+	while(!m->closing)
+	{
+		clock_gettime(CLOCK_REALTIME, &now);
+		ann_deadline(&deadline, &now, m->interval*1000);
+		if(pthread_cond_timedwait(&m->wake, &m->lock, &deadline) != ETIMEDOUT)
+			continue;
+
+		if(stat(m->path, &st) || !ann_model_changed(&st, &m->st))
+			continue;
+		m->st = st;
+		pthread_mutex_unlock(&m->lock);
+
+#ifdef FANN_VERBOSE
+		printf("Reloading neural net '%s'\n", m->path);
+#endif
+
+		v = malloc(sizeof *v);
+		if(v && !(v->ann = fann_create_from_file(m->path)))
+		{
+			free(v);
+			v = NULL;
+		}
+
+		old = NULL;
+		pthread_mutex_lock(&m->lock);
+		if(v)
+		{
+			v->refs = 0;
+			v->number = ++m->reloads + 1;
+			old = m->current;
+			m->current = v;
+			if(old->refs)
+				old = NULL;
+		}
+		pthread_mutex_unlock(&m->lock);
+
+		if(old)
+		{
+			fann_destroy(old->ann);
+			free(old);
+		}
+
+		pthread_mutex_lock(&m->lock);
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	return NULL;
+}
+
+/*! fann.watch(filename, [interval])
+ *# Creates a watched model from the network file {{filename}}, checking the
+ *# file for changes every {{interval}} milliseconds (default 1000).
+ *# Replace the file by renaming a complete new file over it; a file that
+ *# cannot be loaded is skipped and the current network is kept.
+ *x model = fann.watch("xor_float.net", 5000)
+ *-
+ */
+static int ann_model_create(lua_State *L)
+{
+	struct ann_model *m;
+	const char *fname;
+	int interval;
+
+	fname = luaL_checkstring(L, 1);
+	interval = luaL_optinteger(L, 2, 1000);
+	luaL_argcheck(L, interval > 0, 2, "interval must be positive");
+
+#ifdef FANN_VERBOSE
+	printf("Watching neural net '%s'\n", fname);
+#endif
+
+	m = lua_newuserdata(L, sizeof *m);
+	memset(m, 0, sizeof *m);
+	m->interval = interval;
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->wake, NULL);
+
+	luaL_getmetatable(L, FANN_MODEL_METATABLE);
+	lua_setmetatable(L, -2);
+
+	m->path = malloc(strlen(fname) + 1);
+	m->current = calloc(1, sizeof *m->current);
+	if(!m->path || !m->current)
+		luaL_error(L, "out of memory");
+	strcpy(m->path, fname);
+
+	if(stat(fname, &m->st) || !(m->current->ann = fann_create_from_file(fname)))
+		luaL_error(L, "Unable to create neural network from %s", fname);
+	m->current->number = 1;
+
+	if(pthread_create(&m->thread, NULL, ann_model_watcher, m))
+		luaL_error(L, "Unable to start watching %s", fname);
+	m->started = 1;
+
+	return 1;
+}
+
+/*! model:run(input1, input2, ..., inputn)
+ *# Evaluates the current version of the network for the given inputs.
+ *x xor = model:run(-1, 1)
+ *-
+ */
+static int ann_model_run(lua_State *L)
+{
+	struct ann_model *m;
+	struct ann_model_version *v;
+	int nin, nout, i;
+	fann_type *input, *output;
+
+	m = luaL_checkudata(L, 1, FANN_MODEL_METATABLE);
+	luaL_argcheck(L, m != NULL, 1, "'watched model' expected");
+	if(!m->current)
+		luaL_error(L, "watched model is closed");
+
+	nin = lua_gettop(L) - 1;
+	for(i = 0; i < nin; i++)
+		luaL_checknumber(L, i + 2);
+	input = lua_newuserdata(L, nin*(sizeof *input) + 1);
+
+	v = ann_model_acquire(m);
+	nout = fann_get_num_output(v->ann);
+	if(nin != (int)fann_get_num_input(v->ann))
+	{
+		i = fann_get_num_input(v->ann);
+		ann_model_release(m, v);
+		return luaL_error(L, "wrong number of inputs: expected %d, got %d", i, nin);
+	}
+	if(!lua_checkstack(L, nout))
+	{
+		ann_model_release(m, v);
+		return luaL_error(L, "too many outputs");
+	}
+
+	for(i = 0; i < nin; i++)
+		input[i] = ann_tofann(ann_multiplier(v->ann), lua_tonumber(L, i + 2));
+	output = fann_run(v->ann, input);
+	for(i = 0; i < nout; i++)
+		lua_pushnumber(L, ann_fromfann(ann_multiplier(v->ann), output[i]));
+
+	ann_model_release(m, v);
+	return nout;
+}
+
+/*! model:version()
+ *# Returns the version number of the current network, starting at 1 and
+ *# counting up with every reload.
+ *x print(model:version())
+ *-
+ */
+static int ann_model_version(lua_State *L)
+{
+	struct ann_model *m;
+	unsigned int number;
+
+	m = luaL_checkudata(L, 1, FANN_MODEL_METATABLE);
+	luaL_argcheck(L, m != NULL, 1, "'watched model' expected");
+	if(!m->current)
+		luaL_error(L, "watched model is closed");
+
+	pthread_mutex_lock(&m->lock);
+	number = m->current->number;
+	pthread_mutex_unlock(&m->lock);
+
+	lua_pushinteger(L, number);
+	return 1;
+}
+
+/*! model:close()
+ *# Stops watching the file and destroys the network. Also called when the
+ *# model is garbage collected.
+ *x model:close()
+ *-
+ */
+static int ann_model_close(lua_State *L)
+{
+	struct ann_model *m;
+
+	m = luaL_checkudata(L, 1, FANN_MODEL_METATABLE);
+	luaL_argcheck(L, m != NULL, 1, "'watched model' expected");
+
+#ifdef FANN_VERBOSE
+	printf("Closing watched model\n");
+#endif
+
+	if(m->started)
+	{
+		pthread_mutex_lock(&m->lock);
+		m->closing = 1;
+		pthread_cond_signal(&m->wake);
+		pthread_mutex_unlock(&m->lock);
+		pthread_join(m->thread, NULL);
+		m->started = 0;
+	}
+
+	if(m->current)
+	{
+		if(m->current->ann)
+			fann_destroy(m->current->ann);
+		free(m->current);
+		m->current = NULL;
+	}
+	free(m->path);
+	m->path = NULL;
+
+	if(m->interval)
+	{
+		pthread_cond_destroy(&m->wake);
+		pthread_mutex_destroy(&m->lock);
+		m->interval = 0;
+	}
+
+	return 0;
+}
+
+/*! model:__tostring()
+ *# Converts a watched model to a string for Lua's virtual machine
+ *x print(model)
+ *-
+ */
+static int ann_model_tostring(lua_State *L)
+{
+	struct ann_model *m;
+
+	m = luaL_checkudata(L, 1, FANN_MODEL_METATABLE);
+	luaL_argcheck(L, m != NULL, 1, "'watched model' expected");
+
+	lua_pushfstring(L, "[[FANN watched model: %s]]", m->path ? m->path : "closed");
+	return 1;
+}
+
+/******************************************************************************
+*h Shared Networks
+*# Shared networks are kept in a process-wide registry, so that every Lua
+*# state and thread in the process can evaluate the same network without
+*# holding its own copy of the weights. A handle to a shared network only
+*# owns the neuron values {{fann_run()}} needs as scratch space. Shared
+*# networks are read only: they can be evaluated, but not trained.
+******************************************************************************/
+
+struct ann_shared_model
+{
+	struct ann_shared_model *next;
+	char *key;
+	struct fann *ann;		/* owns the weights every handle reads */
+	int refs;				/* handles, plus one while registered */
+};
+
+struct ann_shared_handle
+{
+	struct ann_shared_model *model;
+	struct fann *ann;		/* private view of model->ann */
+};
+
+static pthread_mutex_t ann_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ann_shared_model *ann_shared_models;
+
+/*
+ * Creates a view of master that shares its weights but has its own layers,
+ * neurons and output buffer, which is all fann_run() writes to.
+ */
+static struct fann *ann_shared_view(struct fann *master)
+{
+	struct fann *ann;
+	struct fann_neuron *neurons, *master_neurons = master->first_layer->first_neuron;
+	unsigned int num_layers = master->last_layer - master->first_layer;
+	unsigned int i;
+
+	ann = malloc(sizeof *ann);
+	if(!ann)
+		return NULL;
+	memcpy(ann, master, sizeof *ann);
+
+	ann->first_layer = malloc(num_layers*(sizeof *ann->first_layer));
+	neurons = malloc(master->total_neurons*(sizeof *neurons));
+	ann->output = malloc(master->num_output*(sizeof *ann->output));
+	ann->connections = NULL;
+	if(master->connection_rate < 1)
+		ann->connections = malloc(master->total_connections*(sizeof *ann->connections));
+
+	if(!ann->first_layer || !neurons || !ann->output
+	   || (master->connection_rate < 1 && !ann->connections))
+	{
+		free(ann->first_layer);
+		free(neurons);
+		free(ann->output);
+		free(ann->connections);
+		free(ann);
+		return NULL;
+	}
+
+	memcpy(neurons, master_neurons, master->total_neurons*(sizeof *neurons));
+	ann->last_layer = ann->first_layer + num_layers;
+	for(i = 0; i < num_layers; i++)
+	{
+		ann->first_layer[i].first_neuron = neurons + (master->first_layer[i].first_neuron - master_neurons);
+		ann->first_layer[i].last_neuron = neurons + (master->first_layer[i].last_neuron - master_neurons);
+	}
+
+	/* Sparse networks reach their inputs through the connection array */
+	if(ann->connections)
+	{
+		for(i = 0; i < master->total_connections; i++)
+			ann->connections[i] = neurons + (master->connections[i] - master_neurons);
+	}
+
+	ann->errstr = NULL;
+	ann->train_errors = NULL;
+	ann->train_slopes = NULL;
+	ann->prev_steps = NULL;
+	ann->prev_train_slopes = NULL;
+	ann->prev_weights_deltas = NULL;
+
+	return ann;
+}
+
+static void ann_shared_view_destroy(struct fann *ann)
+{
+	free(ann->first_layer->first_neuron);
+	free(ann->first_layer);
+	free(ann->output);
+	free(ann->connections);
+	free(ann);
+}
+
+/*
+ * Removes model from the registry. Must be called with ann_shared_lock held.
+ */
+static void ann_shared_unlist(struct ann_shared_model *model)
+{
+	struct ann_shared_model **it;
+
+	for(it = &ann_shared_models; *it != model; it = &(*it)->next)
+		;
+	*it = model->next;
+}
+
+/*
+ * Drops one reference to model; the last one destroys the master network.
+ * Must be called with ann_shared_lock held.
+ */
+static void ann_shared_unref(struct ann_shared_model *model)
+{
+	if(--model->refs > 0)
+		return;
+
+	fann_destroy(model->ann);
+	free(model->key);
+	free(model);
+}
+
+/*! fann.share(key, [ann])
+ *# Returns a handle to the shared network registered under {{key}}.\n
+ *# With {{ann}}, a copy of {{ann}} is registered under {{key}}, replacing
+ *# any network registered earlier; handles to the earlier network keep
+ *# working. Without {{ann}}, a network not registered yet is loaded from the
+ *# file named {{key}}. The registry keeps a network until it is replaced or
+ *# removed with {{fann.unshare()}}, after which it is destroyed once its last
+ *# handle, in any Lua state, is collected.
+ *x shared = fann.share("models/xor.net")
+ *-
+ */
+static int ann_shared_create(lua_State *L)
+{
+	struct ann_shared_handle *h;
+	struct ann_shared_model *model;
+	struct fann **ann = NULL;
+	struct fann *master = NULL;
+	const char *key;
+
+	key = luaL_checkstring(L, 1);
+	if(!lua_isnoneornil(L, 2))
+	{
+		ann = luaL_checkudata(L, 2, FANN_METATABLE);
+		luaL_argcheck(L, ann != NULL, 2, "'neural net' expected");
+	}
+
+	h = lua_newuserdata(L, sizeof *h);
+	h->model = NULL;
+	h->ann = NULL;
+	luaL_getmetatable(L, FANN_SHARED_METATABLE);
+	lua_setmetatable(L, -2);
+
+	/* Networks are copied or loaded outside the lock */
+	if(ann)
+	{
+		master = fann_copy(*ann);
+		if(!master)
+			luaL_error(L, "Unable to copy neural network");
+	}
+	else
+	{
+		pthread_mutex_lock(&ann_shared_lock);
+		for(model = ann_shared_models; model; model = model->next)
+			if(!strcmp(model->key, key))
+				break;
+		pthread_mutex_unlock(&ann_shared_lock);
+
+		if(!model)
+		{
+#ifdef FANN_VERBOSE
+			printf("Loading shared neural net '%s'\n", key);
+#endif
+			master = fann_create_from_file(key);
+			if(!master)
+				luaL_error(L, "Unable to create neural network from %s", key);
+		}
+	}
+
+	pthread_mutex_lock(&ann_shared_lock);
+	for(model = ann_shared_models; model; model = model->next)
+		if(!strcmp(model->key, key))
+			break;
+
+	if(master && (ann || !model))
+	{
+		struct ann_shared_model *added = calloc(1, sizeof *added);
+
+		if(added)
+			added->key = malloc(strlen(key) + 1);
+		if(!added || !added->key)
+		{
+			pthread_mutex_unlock(&ann_shared_lock);
+			if(added)
+				free(added);
+			fann_destroy(master);
+			return luaL_error(L, "out of memory");
+		}
+		strcpy(added->key, key);
+		added->ann = master;
+		added->refs = 1;
+		master = NULL;
+
+		if(model)
+		{
+			ann_shared_unlist(model);
+			ann_shared_unref(model);
+		}
+
+		added->next = ann_shared_models;
+		ann_shared_models = added;
+		model = added;
+	}
+
+	if(!model)
+	{
+		pthread_mutex_unlock(&ann_shared_lock);
+		return luaL_error(L, "shared neural net %s was removed while opening it", key);
+	}
+
+	model->refs++;
+	h->model = model;
+	pthread_mutex_unlock(&ann_shared_lock);
+
+	/* Another thread registered the file first */
+	if(master)
+		fann_destroy(master);
+
+	h->ann = ann_shared_view(model->ann);
+	if(!h->ann)
+		luaL_error(L, "out of memory");
+
+	return 1;
+}
+
+/*! fann.unshare(key)
+ *# Removes the network registered under {{key}} from the registry. Existing
+ *# handles keep working.
+ *x fann.unshare("models/xor.net")
+ *-
+ */
+static int ann_shared_remove(lua_State *L)
+{
+	struct ann_shared_model *model;
+	const char *key;
+	int found;
+
+	key = luaL_checkstring(L, 1);
+
+	pthread_mutex_lock(&ann_shared_lock);
+	for(model = ann_shared_models; model; model = model->next)
+		if(!strcmp(model->key, key))
+			break;
+	found = model != NULL;
+	if(model)
+	{
+		ann_shared_unlist(model);
+		ann_shared_unref(model);
+	}
+	pthread_mutex_unlock(&ann_shared_lock);
+
+	lua_pushboolean(L, found);
+	return 1;
+}
+
+/*! shared:run(input1, input2, ..., inputn)
+ *# Evaluates the shared network for the given inputs.
+ *x xor = shared:run(-1, 1)
+ *-
+ */
+static int ann_shared_run(lua_State *L)
+{
+	struct ann_shared_handle *h;
+
+	h = luaL_checkudata(L, 1, FANN_SHARED_METATABLE);
+	luaL_argcheck(L, h != NULL, 1, "'shared neural net' expected");
+	if(!h->ann)
+		luaL_error(L, "shared neural net is closed");
+
+	return ann_run_stack(L, h->ann, 2, NULL);
+}
+
+/*! shared:close()
+ *# Releases the handle. Also called when the handle is garbage collected.
+ *x shared:close()
+ *-
+ */
+static int ann_shared_close(lua_State *L)
+{
+	struct ann_shared_handle *h;
+
+	h = luaL_checkudata(L, 1, FANN_SHARED_METATABLE);
+	luaL_argcheck(L, h != NULL, 1, "'shared neural net' expected");
+
+	if(h->ann)
+	{
+		ann_shared_view_destroy(h->ann);
+		h->ann = NULL;
+	}
+
+	if(h->model)
+	{
+		pthread_mutex_lock(&ann_shared_lock);
+		ann_shared_unref(h->model);
+		pthread_mutex_unlock(&ann_shared_lock);
+		h->model = NULL;
+	}
+
+	return 0;
+}
+
+/*! shared:__tostring()
+ *# Converts a shared network handle to a string for Lua's virtual machine
+ *x print(shared)
+ *-
+ */
+static int ann_shared_tostring(lua_State *L)
+{
+	struct ann_shared_handle *h;
+
+	h = luaL_checkudata(L, 1, FANN_SHARED_METATABLE);
+	luaL_argcheck(L, h != NULL, 1, "'shared neural net' expected");
+
+	if(!h->ann)
+		lua_pushliteral(L, "[[FANN shared neural network: closed]]");
+	else
+		lua_pushfstring(L, "[[FANN shared neural network: %s %d %d %d]]", h->model->key,
+						fann_get_num_input(h->ann), fann_get_num_output(h->ann),
+						fann_get_total_neurons(h->ann));
+	return 1;
+}
+
+/******************************************************************************
+*h Streams
+*# A stream evaluates a network over a sliding window of a signal. The
+*# network's inputs are the last {{frames}} samples of the signal, each
+*# sample being {{channels}} values, oldest first. The stream keeps the
+*# window in a ring buffer stored twice over, so that the window is always
+*# one contiguous run of values that {{fann_run()}} reads in place.
+******************************************************************************/
+
+struct ann_stream
+{
+	struct fann **ann;
+	int ann_ref;
+	unsigned int channels, frames;
+	unsigned int pos;		/* frame the next sample goes to */
+	unsigned int filled;	/* samples in the window, up to frames */
+	fann_type *buf;			/* 2 x frames x channels values */
+};
+
+/*
+ * Adds one sample to the window. Returns the window if it is full, or NULL.
+ */
+static fann_type *ann_stream_add(struct ann_stream *s, const fann_type *sample)
+{
+	fann_type *window;
+
+	memcpy(s->buf + s->pos*s->channels, sample, s->channels*sizeof(fann_type));
+	memcpy(s->buf + (s->pos + s->frames)*s->channels, sample, s->channels*sizeof(fann_type));
+	if(++s->pos == s->frames)
+		s->pos = 0;
+	if(s->filled < s->frames)
+		s->filled++;
+
+	window = s->buf + s->pos*s->channels;
+	return s->filled == s->frames ? window : NULL;
+}
+
+static struct ann_stream *ann_checkstream(lua_State *L)
+{
+	struct ann_stream *s;
+
+	s = luaL_checkudata(L, 1, FANN_STREAM_METATABLE);
+	luaL_argcheck(L, s != NULL, 1, "'stream' expected");
+	if(!*s->ann)
+		luaL_error(L, "the stream's neural net is closed");
+	return s;
+}
+
+/*! ann:stream([channels])
+ *# Creates a stream evaluating the network over a window of the last
+ *# samples of a signal of {{channels}} values per sample (default 1). The
+ *# number of inputs of the network must be a multiple of {{channels}}.
+ *x stream = ann:stream(3)
+ *-
+ */
+static int ann_stream_create(lua_State *L)
+{
+	struct fann **ann;
+	struct ann_stream *s;
+	unsigned int nin;
+	int channels;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	channels = luaL_optinteger(L, 2, 1);
+	nin = fann_get_num_input(*ann);
+	luaL_argcheck(L, channels > 0 && nin % channels == 0, 2, "inputs are not a whole number of samples");
+
+	s = lua_newuserdata(L, sizeof *s + 2*nin*sizeof(fann_type));
+	memset(s, 0, sizeof *s);
+	s->ann = ann;
+	s->channels = channels;
+	s->frames = nin / channels;
+	s->buf = (fann_type *)(s + 1);
+
+	lua_pushvalue(L, 1);
+	s->ann_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	luaL_getmetatable(L, FANN_STREAM_METATABLE);
+	lua_setmetatable(L, -2);
+
+#ifdef FANN_VERBOSE
+	printf("Creating stream: %d frames of %d channels\n", s->frames, s->channels);
+#endif
+
+	return 1;
+}
+
+/*! stream:push(value1, value2, ..., valuen)
+ *# Appends a sample of {{channels}} values to the window. Once the window
+ *# is full, evaluates the network on it and returns its outputs; until
+ *# then, returns nothing.
+ *x out = stream:push(0.3)
+ *-
+ */
+static int ann_stream_push(lua_State *L)
+{
+	struct ann_stream *s;
+	fann_type sample[16], *window, *output, *in = sample;
+	unsigned int i, nout;
+
+	s = ann_checkstream(L);
+	if(lua_gettop(L) - 1 != (int)s->channels)
+		luaL_error(L, "wrong number of values: expected %d, got %d", s->channels, lua_gettop(L) - 1);
+
+	if(s->channels > sizeof sample/sizeof *sample)
+		in = lua_newuserdata(L, s->channels*sizeof(fann_type));
+	for(i = 0; i < s->channels; i++)
+		in[i] = ann_tofann(ann_multiplier(*s->ann), luaL_checknumber(L, i + 2));
+
+	window = ann_stream_add(s, in);
+	if(!window)
+		return 0;
+
+	output = fann_run(*s->ann, window);
+	nout = fann_get_num_output(*s->ann);
+	luaL_checkstack(L, nout, "too many outputs");
+	for(i = 0; i < nout; i++)
+		lua_pushnumber(L, ann_fromfann(ann_multiplier(*s->ann), output[i]));
+	return nout;
+}
+
+/*! stream:push_many(values)
+ *# Appends the samples in the table {{values}}, the values of each sample
+ *# one after the other, evaluating the network on the window after each
+ *# sample once the window is full. Returns a table of the outputs of every
+ *# evaluation, one after the other.
+ *x outs = stream:push_many({0.1, 0.2, 0.3, 0.4})
+ *-
+ */
+static int ann_stream_push_many(lua_State *L)
+{
+	struct ann_stream *s;
+	fann_type *sample, *window, *output;
+	unsigned int i, j, n, nout, count = 0;
+
+	s = ann_checkstream(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	n = lua_rawlen(L, 2);
+	if(n % s->channels)
+		luaL_error(L, "%d values are not a whole number of samples", n);
+
+	nout = fann_get_num_output(*s->ann);
+	sample = lua_newuserdata(L, s->channels*sizeof(fann_type));
+	lua_createtable(L, n / s->channels * nout, 0);
+
+	for(i = 0; i < n; i += s->channels)
+	{
+		for(j = 0; j < s->channels; j++)
+		{
+			lua_rawgeti(L, 2, i + j + 1);
+			if(!lua_isnumber(L, -1))
+				luaL_error(L, "value %d is not a number", i + j + 1);
+			sample[j] = ann_tofann(ann_multiplier(*s->ann), lua_tonumber(L, -1));
+			lua_pop(L, 1);
+		}
+
+		window = ann_stream_add(s, sample);
+		if(!window)
+			continue;
+
+		output = fann_run(*s->ann, window);
+		for(j = 0; j < nout; j++)
+		{
+			lua_pushnumber(L, ann_fromfann(ann_multiplier(*s->ann), output[j]));
+			lua_rawseti(L, -2, ++count);
+		}
+	}
+
+	return 1;
+}
+
+/*! stream:reset()
+ *# Empties the window
+ *x stream:reset()
+ *-
+ */
+static int ann_stream_reset(lua_State *L)
+{
+	struct ann_stream *s;
+
+	s = luaL_checkudata(L, 1, FANN_STREAM_METATABLE);
+	luaL_argcheck(L, s != NULL, 1, "'stream' expected");
+
+	s->pos = 0;
+	s->filled = 0;
+	return 0;
+}
+
+/*! stream:__gc()
+ *# Releases the stream's network
+ *-
+ */
+static int ann_stream_gc(lua_State *L)
+{
+	struct ann_stream *s;
+
+	s = luaL_checkudata(L, 1, FANN_STREAM_METATABLE);
+	luaL_argcheck(L, s != NULL, 1, "'stream' expected");
+
+	luaL_unref(L, LUA_REGISTRYINDEX, s->ann_ref);
+	s->ann_ref = LUA_NOREF;
+	return 0;
+}
+
+/*! stream:__tostring()
+ *# Converts a stream to a string for Lua's virtual machine
+ *x print(stream)
+ *-
+ */
+static int ann_stream_tostring(lua_State *L)
+{
+	struct ann_stream *s;
+
+	s = luaL_checkudata(L, 1, FANN_STREAM_METATABLE);
+	luaL_argcheck(L, s != NULL, 1, "'stream' expected");
+
+	lua_pushfstring(L, "[[FANN stream: %d frames of %d channels, %d filled]]", s->frames, s->channels, s->filled);
+	return 1;
+}
+
+/******************************************************************************
+*h Pipelines
+*# A pipeline chains several networks and runs the whole chain in C. Each
+*# stage runs one network, or one of several expert networks picked by the
+*# largest output of an earlier gating stage, on inputs gathered from
+*# slices of the outputs of earlier stages. Stage 0 stands for the
+*# pipeline's own inputs. All intermediate buffers are allocated when the
+*# pipeline is built.
+******************************************************************************/
+
+struct ann_pipe_slice
+{
+	unsigned int from, first, count;
+};
+
+struct ann_pipe_stage
+{
+	struct fann ***nets;	/* one network, or the experts */
+	unsigned int nnets;
+	int gate;				/* stage picking the expert, or -1 */
+	struct ann_pipe_slice *slices;
+	unsigned int nslices;
+	unsigned int nin, nout;
+	unsigned int multiplier;	/* of the fixed point values in output */
+	fann_type *input, *output;
+};
+
+struct ann_pipeline
+{
+	int ref;				/* table keeping the networks and buffers alive */
+	unsigned int nstages;	/* including stage 0, the inputs */
+	struct ann_pipe_stage *stages;
+};
+
+/*
+ * Allocates size bytes owned by the table at index keep
+ */
+static void *ann_pipe_alloc(lua_State *L, int keep, size_t size)
+{
+	void *p = lua_newuserdata(L, size + 1);
+
+	lua_rawseti(L, keep, lua_rawlen(L, keep) + 1);
+	return p;
+}
+
+/*
+ * Pops the network at the top of the stack into the table at index keep
+ */
+static struct fann **ann_pipe_net(lua_State *L, int keep, unsigned int stage)
+{
+	struct fann **ann = lua_touserdata(L, -1);
+	int ok = 0;
+
+	if(ann && lua_getmetatable(L, -1))
+	{
+		luaL_getmetatable(L, FANN_METATABLE);
+		ok = lua_rawequal(L, -1, -2) && *ann;
+		lua_pop(L, 2);
+	}
+	if(!ok)
+		luaL_error(L, "stage %d: neural net expected", stage);
+
+	lua_rawseti(L, keep, lua_rawlen(L, keep) + 1);
+	return ann;
+}
+
+/*
+ * Reads the description of stage i from the table at index spec
+ */
+static void ann_pipe_stage(lua_State *L, int spec, int keep, struct ann_pipeline *p, unsigned int i)
+{
+	struct ann_pipe_stage *s = &p->stages[i];
+	struct ann_pipe_slice *slice;
+	unsigned int j, nin, avail;
+
+	lua_getfield(L, spec, "experts");
+	if(lua_istable(L, -1))
+	{
+		s->nnets = lua_rawlen(L, -1);
+		if(s->nnets < 1)
+			luaL_error(L, "stage %d: no experts", i);
+		s->nets = ann_pipe_alloc(L, keep, s->nnets*(sizeof *s->nets));
+		for(j = 0; j < s->nnets; j++)
+		{
+			lua_rawgeti(L, -1, j + 1);
+			s->nets[j] = ann_pipe_net(L, keep, i);
+		}
+
+		lua_getfield(L, spec, "gate");
+		s->gate = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if(s->gate < 1 || (unsigned int)s->gate >= i)
+			luaL_error(L, "stage %d: gate must be an earlier stage", i);
+		if(p->stages[s->gate].nout != s->nnets)
+			luaL_error(L, "stage %d: gate has %d outputs for %d experts", i, p->stages[s->gate].nout, s->nnets);
+	}
+	else
+	{
+		s->nnets = 1;
+		s->nets = ann_pipe_alloc(L, keep, sizeof *s->nets);
+		lua_getfield(L, spec, "net");
+		s->nets[0] = ann_pipe_net(L, keep, i);
+		s->gate = -1;
+	}
+	lua_pop(L, 1);
+
+	s->nin = fann_get_num_input(*s->nets[0]);
+	s->nout = fann_get_num_output(*s->nets[0]);
+	for(j = 1; j < s->nnets; j++)
+		if(fann_get_num_input(*s->nets[j]) != s->nin || fann_get_num_output(*s->nets[j]) != s->nout)
+			luaL_error(L, "stage %d: experts differ in size", i);
+
+	/* Slices, by default all outputs of the previous stage */
+	lua_getfield(L, spec, "inputs");
+	if(lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, 1, 0);
+		lua_pushinteger(L, i - 1);
+		lua_rawseti(L, -2, 1);
+	}
+	if(!lua_istable(L, -1))
+		luaL_error(L, "stage %d: inputs must be a table", i);
+	s->nslices = lua_rawlen(L, -1);
+	s->slices = ann_pipe_alloc(L, keep, s->nslices*(sizeof *s->slices));
+
+	nin = 0;
+	for(j = 0; j < s->nslices; j++)
+	{
+		slice = &s->slices[j];
+		lua_rawgeti(L, -1, j + 1);
+		if(lua_istable(L, -1))
+		{
+			lua_rawgeti(L, -1, 1);
+			lua_rawgeti(L, -2, 2);
+			lua_rawgeti(L, -3, 3);
+			slice->from = lua_tointeger(L, -3);
+			slice->first = lua_isnil(L, -2) ? 0 : lua_tointeger(L, -2) - 1;
+			slice->count = lua_isnil(L, -1) ? (unsigned int)-1 : (unsigned int)lua_tointeger(L, -1);
+			lua_pop(L, 3);
+		}
+		else
+		{
+			slice->from = lua_tointeger(L, -1);
+			slice->first = 0;
+			slice->count = (unsigned int)-1;
+		}
+		lua_pop(L, 1);
+
+		if(slice->from >= i)
+			luaL_error(L, "stage %d: input %d must come from an earlier stage", i, j + 1);
+		avail = p->stages[slice->from].nout;
+		if(slice->first > avail)
+			luaL_error(L, "stage %d: input %d is out of range", i, j + 1);
+		if(slice->count == (unsigned int)-1)
+			slice->count = avail - slice->first;
+		if(slice->count > avail - slice->first)
+			luaL_error(L, "stage %d: input %d is out of range", i, j + 1);
+		nin += slice->count;
+	}
+	lua_pop(L, 1);
+
+	if(nin != s->nin)
+		luaL_error(L, "stage %d: %d inputs wired to a network of %d inputs", i, nin, s->nin);
+
+	s->input = ann_pipe_alloc(L, keep, (s->nin + s->nout)*sizeof(fann_type));
+	s->output = s->input + s->nin;
+	s->multiplier = ann_multiplier(*s->nets[0]);
+}
+
+/*
+ * Copies n values of multiplier from in src to dst as values of multiplier to
+ */
+static void ann_pipe_copy(fann_type *dst, const fann_type *src, unsigned int n, unsigned int from, unsigned int to)
+{
+	unsigned int i;
+
+	if(from == to)
+		memcpy(dst, src, n*sizeof *dst);
+	else
+	{
+		for(i = 0; i < n; i++)
+			dst[i] = ann_tofann(to, ann_fromfann(from, src[i]));
+	}
+}
+
+/*
+ * Runs the stages on the inputs in stage 0's buffer. Returns the outputs,
+ * or NULL if one of the networks has been closed.
+ */
+static fann_type *ann_pipe_run(struct ann_pipeline *p)
+{
+	struct ann_pipe_stage *s;
+	struct ann_pipe_slice *slice;
+	struct fann *ann;
+	fann_type *in, *out;
+	unsigned int i, j, pick;
+
+	for(i = 1; i < p->nstages; i++)
+	{
+		s = &p->stages[i];
+		pick = 0;
+		if(s->gate >= 0)
+			pick = ann_argmax(p->stages[s->gate].output, s->nnets);
+		ann = *s->nets[pick];
+		if(!ann)
+			return NULL;
+
+		in = s->input;
+		for(j = 0; j < s->nslices; j++)
+		{
+			slice = &s->slices[j];
+			ann_pipe_copy(in, p->stages[slice->from].output + slice->first, slice->count,
+						  p->stages[slice->from].multiplier, ann_multiplier(ann));
+			in += slice->count;
+		}
+
+		out = fann_run(ann, s->input);
+		memcpy(s->output, out, s->nout*sizeof(fann_type));
+		s->multiplier = ann_multiplier(ann);
+	}
+
+	return p->stages[p->nstages - 1].output;
+}
+
+/*! fann.pipeline(stages)
+ *# Builds a pipeline from the list {{stages}}. Each stage is a table with
+ *# either a {{net}}, or a list of {{experts}} and a {{gate}}: the number of
+ *# an earlier stage with one output per expert, whose largest output picks
+ *# the expert to run. The stage's {{inputs}} is a list of slices
+ *# concatenated into the network's inputs, each either a stage number or a
+ *# table {{{stage, first, count}}}, {{first}} defaulting to 1 and
+ *# {{count}} to the rest of that stage's outputs. Stage 0 is the
+ *# pipeline's input, whose size is given by the {{inputs}} field of
+ *# {{stages}}, by default that of the first network. Without {{inputs}},
+ *# a stage takes all outputs of the previous stage.
+ *x p = fann.pipeline{inputs = 8,
+ *x 	{net = features},
+ *x 	{net = router, inputs = {1}},
+ *x 	{experts = {small, large}, gate = 2, inputs = {1, {0, 1, 4}}}}
+ *-
+ */
+static int ann_pipeline_create(lua_State *L)
+{
+	struct ann_pipeline *p;
+	unsigned int i, n;
+	int keep;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	n = lua_rawlen(L, 1);
+	if(n < 1)
+		luaL_error(L, "a pipeline needs at least one stage");
+
+	p = lua_newuserdata(L, sizeof *p);
+	memset(p, 0, sizeof *p);
+	p->ref = LUA_NOREF;
+	luaL_getmetatable(L, FANN_PIPELINE_METATABLE);
+	lua_setmetatable(L, -2);
+
+	lua_newtable(L);
+	keep = lua_gettop(L);
+	p->nstages = n + 1;
+	p->stages = ann_pipe_alloc(L, keep, p->nstages*(sizeof *p->stages));
+	memset(p->stages, 0, p->nstages*(sizeof *p->stages));
+
+	/* Stage 0 only has outputs: the pipeline's inputs */
+	lua_getfield(L, 1, "inputs");
+	if(!lua_isnil(L, -1))
+		p->stages[0].nout = luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
+	p->stages[0].gate = -1;
+
+	for(i = 1; i <= n; i++)
+	{
+		lua_rawgeti(L, 1, i);
+		if(!lua_istable(L, -1))
+			luaL_error(L, "stage %d is not a table", i);
+		if(i == 1 && !p->stages[0].nout)
+		{
+			/* By default the pipeline's inputs are those of its first network */
+			lua_getfield(L, -1, "net");
+			if(lua_isnil(L, -1))
+			{
+				lua_pop(L, 1);
+				lua_getfield(L, -1, "experts");
+				if(!lua_istable(L, -1))
+					luaL_error(L, "stage 1: neural net expected");
+				lua_rawgeti(L, -1, 1);
+				lua_remove(L, -2);
+			}
+			p->stages[0].nout = fann_get_num_input(*ann_pipe_net(L, keep, 1));
+		}
+		if(i == 1)
+			p->stages[0].output = ann_pipe_alloc(L, keep, p->stages[0].nout*sizeof(fann_type));
+		ann_pipe_stage(L, lua_gettop(L), keep, p, i);
+		if(i == 1)
+			p->stages[0].multiplier = p->stages[1].multiplier;
+		lua_pop(L, 1);
+	}
+
+	p->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+#ifdef FANN_VERBOSE
+	printf("Creating pipeline of %d stages\n", n);
+#endif
+
+	return 1;
+}
+
+static struct ann_pipeline *ann_checkpipeline(lua_State *L)
+{
+	struct ann_pipeline *p;
+
+	p = luaL_checkudata(L, 1, FANN_PIPELINE_METATABLE);
+	luaL_argcheck(L, p != NULL, 1, "'pipeline' expected");
+	if(p->ref == LUA_NOREF)
+		luaL_error(L, "pipeline is closed");
+	return p;
+}
+
+/*! pipeline:run(input1, input2, ..., inputn)
+ *# Runs the pipeline for the given inputs and returns the outputs of its
+ *# last stage.
+ *x class = p:run(0.1, 0.5, 0.3, 0.2, 0.9, 0.4, 0.7, 0.0)
+ *-
+ */
+static int ann_pipeline_run(lua_State *L)
+{
+	struct ann_pipeline *p;
+	fann_type *output;
+	unsigned int nin, nout, i;
+
+	p = ann_checkpipeline(L);
+	nin = p->stages[0].nout;
+	nout = p->stages[p->nstages - 1].nout;
+	if(lua_gettop(L) - 1 != (int)nin)
+		luaL_error(L, "wrong number of inputs: expected %d, got %d", nin, lua_gettop(L) - 1);
+
+	for(i = 0; i < nin; i++)
+		p->stages[0].output[i] = ann_tofann(p->stages[0].multiplier, luaL_checknumber(L, i + 2));
+
+	output = ann_pipe_run(p);
+	if(!output)
+		luaL_error(L, "a neural net of the pipeline is closed");
+
+	luaL_checkstack(L, nout, "too many outputs");
+	for(i = 0; i < nout; i++)
+		lua_pushnumber(L, ann_fromfann(p->stages[p->nstages - 1].multiplier, output[i]));
+	return nout;
+}
+
+/*! pipeline:run_batch(rows)
+ *# Runs the pipeline for each table of inputs in the table {{rows}} and
+ *# returns a table of the tables of outputs.
+ *x outputs = p:run_batch(rows)
+ *-
+ */
+static int ann_pipeline_run_batch(lua_State *L)
+{
+	struct ann_pipeline *p;
+	fann_type *output;
+	unsigned int nout, rows, r, i;
+
+	p = ann_checkpipeline(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	nout = p->stages[p->nstages - 1].nout;
+	rows = lua_rawlen(L, 2);
+
+#ifdef FANN_VERBOSE
+	printf("Running pipeline on %d rows\n", rows);
+#endif
+
+	lua_createtable(L, rows, 0);
+	for(r = 0; r < rows; r++)
+	{
+		lua_rawgeti(L, 2, r + 1);
+		ann_checkvector(L, -1, "inputs", p->stages[0].nout, p->stages[0].output, p->stages[0].multiplier);
+		lua_pop(L, 1);
+
+		output = ann_pipe_run(p);
+		if(!output)
+			luaL_error(L, "a neural net of the pipeline is closed");
+
+		lua_createtable(L, nout, 0);
+		for(i = 0; i < nout; i++)
+		{
+			lua_pushnumber(L, ann_fromfann(p->stages[p->nstages - 1].multiplier, output[i]));
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_rawseti(L, -2, r + 1);
+	}
+
+	return 1;
+}
+
+/*! pipeline:__gc()
+ *# Releases the pipeline's networks and buffers
+ *-
+ */
+static int ann_pipeline_gc(lua_State *L)
+{
+	struct ann_pipeline *p;
+
+	p = luaL_checkudata(L, 1, FANN_PIPELINE_METATABLE);
+	luaL_argcheck(L, p != NULL, 1, "'pipeline' expected");
+
+	luaL_unref(L, LUA_REGISTRYINDEX, p->ref);
+	p->ref = LUA_NOREF;
+	return 0;
+}
+
+/*! pipeline:__tostring()
+ *# Converts a pipeline to a string for Lua's virtual machine
+ *x print(p)
+ *-
+ */
+static int ann_pipeline_tostring(lua_State *L)
+{
+	struct ann_pipeline *p;
+
+	p = luaL_checkudata(L, 1, FANN_PIPELINE_METATABLE);
+	luaL_argcheck(L, p != NULL, 1, "'pipeline' expected");
+
+	if(p->ref == LUA_NOREF)
+		lua_pushliteral(L, "[[FANN pipeline: closed]]");
+	else
+		lua_pushfstring(L, "[[FANN pipeline: %d stages, %d inputs, %d outputs]]", p->nstages - 1,
+						p->stages[0].nout, p->stages[p->nstages - 1].nout);
+	return 1;
+}
+
+/******************************************************************************
+*h Traces
+*# A network can record the inputs it is run on with their timing, through
+*# {{ann:run()}}, {{ann:run_packed()}}, {{ann:classify()}} and their batch
+*# versions, to a compact binary trace file. {{fann.replay()}} drives a
+*# network, for example of another build of the module, with a trace to
+*# measure its throughput and latency on real traffic.
+******************************************************************************/
+
+/*! ann:record([filename])
+ *# Starts recording the inputs the network is run on to the trace file
+ *# {{filename}}, replacing it if it exists. Without {{filename}}, stops
+ *# recording and returns the number of calls and of rows recorded.
+ *x ann:record("production.trace")
+ *x calls, rows = ann:record()
+ *-
+ */
+static int ann_record(lua_State *L)
+{
+	struct fann **ann;
+	struct ann_trace *t;
+	const char *fname;
+	uint32_t header[3];
+	lua_Number calls, rows;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+
+	if(!*ann)
+		luaL_error(L, "the neural net is closed");
+
+	fname = luaL_optstring(L, 2, NULL);
+	t = ann_trace_of(ann);
+
+	if(!fname)
+	{
+		if(!t)
+			luaL_error(L, "the neural net is not recording");
+		calls = t->calls;
+		rows = t->rows;
+		if(ann_trace_close(ann))
+			luaL_error(L, "Unable to write the trace");
+		lua_pushnumber(L, calls);
+		lua_pushnumber(L, rows);
+		return 2;
+	}
+
+	if(t && ann_trace_close(ann))
+		luaL_error(L, "Unable to write the trace");
+
+	t = malloc(sizeof *t);
+	if(!t)
+		luaL_error(L, "out of memory");
+	t->f = fopen(fname, "wb");
+	if(!t->f)
+	{
+		free(t);
+		luaL_error(L, "Unable to open %s: %s", fname, strerror(errno));
+	}
+
+#ifdef FANN_VERBOSE
+	printf("Recording neural net to %s\n", fname);
+#endif
+
+	t->calls = 0;
+	t->rows = 0;
+	t->num_input = fann_get_num_input(*ann);
+	t->multiplier = ann_multiplier(*ann);
+	t->value_size = sizeof(fann_type) == sizeof(double) ? sizeof(double) : sizeof(float);
+
+	header[0] = ANN_TRACE_VERSION;
+	header[1] = t->num_input;
+	header[2] = t->value_size;
+	fwrite(ANN_TRACE_MAGIC, 4, 1, t->f);
+	fwrite(header, sizeof header, 1, t->f);
+
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+	((struct ann_net *)ann)->trace = t;
+	return 0;
+}
+
+static int ann_compare_latency(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Sets field name of the table on top of the stack to the p quantile of the
+ * n sorted latencies
+ */
+static void ann_set_quantile(lua_State *L, const char *name, const double *latency, unsigned int n, double p)
+{
+	unsigned int i = (unsigned int)ceil(p*n);
+
+	lua_pushnumber(L, n ? latency[i ? i - 1 : 0] : 0);
+	lua_setfield(L, -2, name);
+}
+
+/*! fann.replay(ann, filename, [options])
+ *# Runs the neural network {{ann}} on the inputs of the trace file
+ *# {{filename}} recorded by {{ann:record()}}, call by call, and returns a
+ *# table of statistics: {{calls}}, {{rows}}, {{seconds}},
+ *# {{calls_per_second}}, {{rows_per_second}}, and the latencies of the calls
+ *# in seconds {{p50}}, {{p99}}, {{p999}} and {{max}}. The trace is read into
+ *# memory first.\n
+ *# By default the calls are replayed one after the other as fast as possible
+ *# and their latencies are the time each takes. With the option
+ *# {{speed}}, they are replayed at that multiple of their recorded pace, and
+ *# latencies count from when a call was due, so that they include the time
+ *# calls wait behind slower ones.
+ *x stats = fann.replay(ann, "production.trace")
+ *x stats = fann.replay(ann, "production.trace", {speed = 1})
+ *-
+ */
+static int ann_replay(lua_State *L)
+{
+	struct fann **ann;
+	const char *fname;
+	FILE *f;
+	long size = 0;
+	char *data, *p, *end;
+	uint32_t header[3], call;
+	uint64_t time, due, begin, now;
+	size_t row_size;
+	unsigned int nin, rows, calls;
+	double speed, seconds, *latency;
+	fann_type *input;
+	struct timespec start, wait;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+	if(!*ann)
+		luaL_error(L, "the neural net is closed");
+
+	fname = luaL_checkstring(L, 2);
+	speed = ann_optnumber(L, 3, "speed", 0);
+	luaL_argcheck(L, speed >= 0, 3, "speed must not be negative");
+	nin = fann_get_num_input(*ann);
+
+	f = fopen(fname, "rb");
+	if(!f)
+		luaL_error(L, "Unable to open %s: %s", fname, strerror(errno));
+	if(fseek(f, 0, SEEK_END) || (size = ftell(f)) < ANN_TRACE_HEADER)
+	{
+		fclose(f);
+		luaL_error(L, "%s is not a trace", fname);
+	}
+	rewind(f);
+	data = lua_newuserdata(L, size);
+	if(fread(data, size, 1, f) != 1)
+	{
+		fclose(f);
+		luaL_error(L, "Unable to read %s", fname);
+	}
+	fclose(f);
+
+	memcpy(header, data + 4, sizeof header);
+	if(memcmp(data, ANN_TRACE_MAGIC, 4) || header[0] != ANN_TRACE_VERSION)
+		luaL_error(L, "%s is not a trace", fname);
+	if(header[1] != nin)
+		luaL_error(L, "the trace has %d inputs, the neural net %d", header[1], nin);
+	if(header[2] != sizeof(float) && header[2] != sizeof(double))
+		luaL_error(L, "%s has values of unknown size %d", fname, header[2]);
+
+	/* A trace cut short by a crash ends at its last whole row */
+	row_size = ANN_TRACE_ROW + (size_t)nin*header[2];
+	rows = (size - ANN_TRACE_HEADER) / row_size;
+	end = data + ANN_TRACE_HEADER + rows*row_size;
+
+	input = lua_newuserdata(L, nin*(sizeof *input) + 1);
+	latency = lua_newuserdata(L, rows*(sizeof *latency) + 1);
+
+#ifdef FANN_VERBOSE
+	printf("Replaying %d rows from %s\n", rows, fname);
+#endif
+
+	calls = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(p = data + ANN_TRACE_HEADER; p < end; )
+	{
+		memcpy(&time, p, sizeof time);
+		memcpy(&call, p + sizeof time, sizeof call);
+
+		begin = ann_trace_clock(&start);
+		if(speed > 0)
+		{
+			due = time / speed;
+			while((now = ann_trace_clock(&start)) < due)
+			{
+				wait.tv_sec = (due - now) / 1000000000;
+				wait.tv_nsec = (due - now) % 1000000000;
+				nanosleep(&wait, NULL);
+			}
+			begin = due;
+		}
+
+		/* The rows of a batch call run back to back */
+		do
+		{
+			ann_unpack(input, p + ANN_TRACE_ROW, nin, header[2], ann_multiplier(*ann));
+			fann_run(*ann, input);
+			p += row_size;
+		}
+		while(p < end && !memcmp(p + sizeof time, &call, sizeof call));
+
+		latency[calls++] = (ann_trace_clock(&start) - begin) / 1e9;
+	}
+	seconds = ann_trace_clock(&start) / 1e9;
+
+	qsort(latency, calls, sizeof *latency, ann_compare_latency);
+
+	lua_createtable(L, 0, 9);
+	lua_pushnumber(L, calls);
+	lua_setfield(L, -2, "calls");
+	lua_pushnumber(L, rows);
+	lua_setfield(L, -2, "rows");
+	lua_pushnumber(L, seconds);
+	lua_setfield(L, -2, "seconds");
+	lua_pushnumber(L, seconds > 0 ? calls / seconds : 0);
+	lua_setfield(L, -2, "calls_per_second");
+	lua_pushnumber(L, seconds > 0 ? rows / seconds : 0);
+	lua_setfield(L, -2, "rows_per_second");
+	ann_set_quantile(L, "p50", latency, calls, 0.5);
+	ann_set_quantile(L, "p99", latency, calls, 0.99);
+	ann_set_quantile(L, "p999", latency, calls, 0.999);
+	ann_set_quantile(L, "max", latency, calls, 1);
+	return 1;
+}
+
+/******************************************************************************
+*h C ABI
+*# Besides the Lua functions, the module exports plain C functions that
+*# evaluate a network on arrays of floats, declared in {{fann.h}}. Under
+*# LuaJIT the {{fann.ffi}} module calls them through the FFI, so that hot
+*# loops calling them stay compiled and allocate nothing per call. Calls
+*# made this way are not recorded by {{ann:record()}}. Fixed point builds
+*# take and give real values, like the Lua functions.
+******************************************************************************/
+
+LUALIB_API unsigned int luafann_num_input(void *handle)
+{
+	struct ann_net *net = handle;
+
+	return net->ann ? fann_get_num_input(net->ann) : 0;
+}
+
+LUALIB_API unsigned int luafann_num_output(void *handle)
+{
+	struct ann_net *net = handle;
+
+	return net->ann ? fann_get_num_output(net->ann) : 0;
+}
+
+LUALIB_API int luafann_run(void *handle, const float *input, float *output)
+{
+	struct ann_net *net = handle;
+	unsigned int nin, nout, i, m;
+	fann_type *in, *out;
+
+	if(!net->ann)
+		return -1;
+	m = ann_multiplier(net->ann);
+	nin = fann_get_num_input(net->ann);
+#if defined(FIXEDFANN) || defined(DOUBLEFANN)
+	in = net->input;
+	for(i = 0; i < nin; i++)
+		in[i] = ann_tofann(m, input[i]);
+#else
+	/* fann_run() only reads the inputs */
+	in = (fann_type *)input;
+	(void)nin;
+#endif
+
+	out = fann_run(net->ann, in);
+	nout = fann_get_num_output(net->ann);
+	for(i = 0; i < nout; i++)
+		output[i] = ann_fromfann(m, out[i]);
+	return 0;
+}
+
+LUALIB_API int luafann_run_batch(void *handle, unsigned int rows, const float *input, float *output)
+{
+	struct ann_net *net = handle;
+	unsigned int nin, nout, r;
+
+	if(!net->ann)
+		return -1;
+	nin = fann_get_num_input(net->ann);
+	nout = fann_get_num_output(net->ann);
+	for(r = 0; r < rows; r++)
+		luafann_run(handle, input + (size_t)r*nin, output + (size_t)r*nout);
+	return 0;
+}
+
+static const struct luafann_abi ann_abi = {
+	LUAFANN_ABI_VERSION,
+	luafann_num_input,
+	luafann_num_output,
+	luafann_run,
+	luafann_run_batch
+};
+
+/*! ann:handle()
+ *# Returns the network as a light userdata handle for the C functions, a
+ *# light userdata pointing to the {{struct luafann_abi}} table of those
+ *# functions, and the numbers of inputs and outputs of the network. The
+ *# handle is only valid as long as {{ann}} is not collected. Once {{ann}}
+ *# is closed with {{ann:__gc()}}, {{luafann_run()}} and
+ *# {{luafann_run_batch()}} return nonzero and leave the outputs alone.
+ *x handle, abi, num_input, num_output = ann:handle()
+ *-
+ */
+static int ann_handle(lua_State *L)
+{
+	struct fann **ann;
+
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+	if(!*ann)
+		luaL_error(L, "the neural net is closed");
+
+#if defined(FIXEDFANN) || defined(DOUBLEFANN)
+	if(!((struct ann_net *)ann)->input)
+	{
+		((struct ann_net *)ann)->input = malloc(fann_get_num_input(*ann)*sizeof(fann_type));
+		if(!((struct ann_net *)ann)->input)
+			luaL_error(L, "out of memory");
+	}
+#endif
+
+	lua_pushlightuserdata(L, ann);
+	lua_pushlightuserdata(L, (void *)&ann_abi);
+	lua_pushinteger(L, fann_get_num_input(*ann));
+	lua_pushinteger(L, fann_get_num_output(*ann));
+	return 4;
+}
+
+#ifndef FIXEDFANN
+/******************************************************************************
+*h Process Groups
+*# A process group trains one network on several processes of the same
+*# host, each holding a shard of the training data and its own copy of the
+*# network. The processes share a POSIX shared memory segment. Each epoch,
+*# every process trains its copy on its shard with {{fann_train_epoch()}},
+*# and then they average their weights and add up their errors in it, so
+*# the copies stay identical. Processes wait for each other at barriers
+*# made of a robust process-shared mutex and condition variable. While
+*# waiting, they check every second that the other workers are still
+*# alive, so a crashed worker stops the group however long epochs take.
+******************************************************************************/
+
+#define ANN_SHM_MAGIC "LFANNSH2"
+
+/* How often workers look for worker 0's segment */
+static const struct timespec ann_shm_poll = {0, 100000000};
+
+/* How often, in seconds, workers at a barrier check the others are alive */
+#define ANN_SHM_CHECK 1
+
+struct ann_shm_header
+{
+	char magic[8];			/* written last by worker 0 */
+	uint32_t nworkers, type_size, max_connections;
+	pid_t owner;			/* worker 0, to tell a live group from a crashed one */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t arrived;		/* workers at the current barrier */
+	uint32_t generation;	/* barriers passed */
+	uint32_t broken;		/* a worker died or timed out at a barrier */
+};
+
+/* One per worker, followed by max_connections fann_type values */
+struct ann_shm_slot
+{
+	double mse;
+	uint32_t num_mse, bit_fail, num_data;
+	pid_t pid;				/* 0 until the worker has joined */
+};
+
+struct ann_shm_group
+{
+	char *name;
+	unsigned int nworkers, rank;
+	int timeout;
+	size_t size, slot_size;
+	struct ann_shm_header *shm;
+};
+
+static struct ann_shm_slot *ann_shm_slot(struct ann_shm_group *g, unsigned int rank)
+{
+	return (struct ann_shm_slot *)((char *)(g->shm + 1) + rank*g->slot_size);
+}
 
-	lua_pushfstring(L, "[[FANN training data]]");
-	return 1;
+static fann_type *ann_shm_values(struct ann_shm_group *g, unsigned int rank)
+{
+	return (fann_type *)(ann_shm_slot(g, rank) + 1);
 }
 
-/*! ann:train_on_file(file, max_epochs, epochs_between_reports, desired_error)
- *# Trains the neural network on the data in the file {{file}}, for up to
- *# {{max_epochs}} epochs, reporting every {{epochs_between_reports}}.
- *# Training stops when the error reaches {{desired_error}}
- *x ann:train_on_file("xor.data", 500000, 1000, 0.001)
- *-
+/*
+ * Locks the group's mutex. If a worker died holding it, the barrier count
+ * can no longer be trusted and the group is marked broken.
  */
-static int ann_train_on_file(lua_State *L)
+static int ann_shm_lock(struct ann_shm_header *h)
 {
-	struct fann **ann;
-	const char *fname;
-	int max_epochs, epochs_between_reports;
-	float desired_error;
-
-	ann = luaL_checkudata(L, 1, FANN_METATABLE);
-	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+	int err;
 
-	if(lua_gettop(L) < 5)
-		luaL_error(L, "insufficient parameters");
+	err = pthread_mutex_lock(&h->lock);
+	if(err == EOWNERDEAD)
+	{
+		h->broken = 1;
+		pthread_mutex_consistent(&h->lock);
+		err = 0;
+	}
+	return err;
+}
 
-	fname = lua_tostring(L, 2);
-	max_epochs = lua_tointeger(L, 3);
-	epochs_between_reports = lua_tointeger(L, 4);
-	desired_error = lua_tonumber(L, 5);
+/*
+ * Returns whether every worker of the group is alive. A worker that has
+ * not joined yet counts as alive unless missing is set.
+ */
+static int ann_shm_alive(struct ann_shm_group *g, int missing)
+{
+	unsigned int r;
+	pid_t pid;
 
-#ifdef FANN_VERBOSE
-	printf("Training on file \"%s\" for up to %d epochs...\n", fname, max_epochs);
-#endif
+	for(r = 0; r < g->nworkers; r++)
+	{
+		pid = ann_shm_slot(g, r)->pid;
+		if(!pid ? missing : kill(pid, 0) && errno == ESRCH)
+			return 0;
+	}
+	return 1;
+}
 
-	fann_train_on_file(*ann, fname, max_epochs, epochs_between_reports, desired_error);
-	return 0;
+/*
+ * Waits until every worker of the group has called it, however long that
+ * takes. Raises an error if a worker died, or had not joined the group
+ * within the group's timeout; the group is then broken and every later
+ * barrier fails at once.
+ */
+static void ann_shm_barrier(lua_State *L, struct ann_shm_group *g)
+{
+	struct ann_shm_header *h = g->shm;
+	struct timespec start, wake;
+	uint32_t generation;
+	int err, broken;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if(ann_shm_lock(h))
+		luaL_error(L, "Unable to lock process group %s", g->name);
+	generation = h->generation;
+	broken = h->broken;
+	if(!broken && ++h->arrived == g->nworkers)
+	{
+		h->arrived = 0;
+		h->generation++;
+		pthread_cond_broadcast(&h->cond);
+	}
+	while(!h->broken && generation == h->generation)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &wake);
+		wake.tv_sec += ANN_SHM_CHECK;
+		err = pthread_cond_timedwait(&h->cond, &h->lock, &wake);
+		if(err == EOWNERDEAD)
+		{
+			h->broken = 1;
+			pthread_mutex_consistent(&h->lock);
+		}
+		else if(err == ETIMEDOUT && generation == h->generation
+				&& !ann_shm_alive(g, wake.tv_sec - start.tv_sec > g->timeout))
+			h->broken = 1;
+	}
+	if(h->broken && !broken)
+		pthread_cond_broadcast(&h->cond);
+	broken = generation == h->generation;
+	pthread_mutex_unlock(&h->lock);
+
+	if(broken)
+		luaL_error(L, "process group %s failed: a worker died or did not join within %d seconds",
+				   g->name, g->timeout);
 }
 
-/*! ann:train_on_data(train, max_epochs, epochs_between_reports, desired_error)
- *# Trains the neural network on the data in {{train}}, for up to
- *# {{max_epochs}} epochs, reporting every {{epochs_between_reports}}.
- *# Training stops when the error reaches {{desired_error}}
- *x ann:train_on_data(train, 500000, 1000, 0.001)
- *-
+/*
+ * Sets the first n values to the average of those of every worker's slot,
+ * weighted by the number of samples of the worker's shard. The workers are
+ * added up in rank order, so that every worker computes exactly the same.
  */
-static int ann_train_on_data(lua_State *L)
+static void ann_shm_average(struct ann_shm_group *g, fann_type *values, unsigned int n)
 {
-	struct fann **ann;
-	struct fann_train_data **train;
-	int max_epochs, epochs_between_reports;
-	float desired_error;
+	unsigned int r, i, total = 0;
+	struct ann_shm_slot *slot;
+	const fann_type *v;
+	double w;
+
+	for(r = 0; r < g->nworkers; r++)
+		total += ann_shm_slot(g, r)->num_data;
+	if(!total)
+		return;
+
+	memset(values, 0, n*sizeof(fann_type));
+	for(r = 0; r < g->nworkers; r++)
+	{
+		slot = ann_shm_slot(g, r);
+		if(!slot->num_data)
+			continue;
+		v = ann_shm_values(g, r);
+		w = (double)slot->num_data / total;
+		for(i = 0; i < n; i++)
+			values[i] += v[i]*w;
+	}
+}
 
-	if(lua_gettop(L) < 5)
-		luaL_error(L, "insufficient parameters");
+/*
+ * Maps the segment name if worker 0 of a live group has finished setting it
+ * up. Returns NULL while the segment is missing or still being set up, or if
+ * it was left over by a worker 0 that is gone.
+ */
+static struct ann_shm_header *ann_shm_attach(const char *name, size_t *size)
+{
+	struct ann_shm_header *h;
+	struct stat st;
+	void *mem;
+	int fd;
 
-	ann = luaL_checkudata(L, 1, FANN_METATABLE);
-	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+	fd = shm_open(name, O_RDWR, 0600);
+	if(fd < 0)
+		return NULL;
 
-	train = luaL_checkudata(L, 2, FANN_TRAIN_METATABLE);
-	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+	/* Mapping past the end of a segment not sized yet would raise SIGBUS */
+	if(fstat(fd, &st) || st.st_size < (off_t)sizeof *h)
+	{
+		close(fd);
+		return NULL;
+	}
+	mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mem == MAP_FAILED)
+		return NULL;
+
+	h = mem;
+	__sync_synchronize();
+	if(memcmp(h->magic, ANN_SHM_MAGIC, sizeof h->magic)
+	   || (kill(h->owner, 0) && errno != EPERM))
+	{
+		munmap(mem, st.st_size);
+		return NULL;
+	}
 
-	max_epochs = lua_tointeger(L, 3);
-	epochs_between_reports = lua_tointeger(L, 4);
-	desired_error = lua_tonumber(L, 5);
+	*size = st.st_size;
+	return h;
+}
 
-#ifdef FANN_VERBOSE
-	printf("Training on data for up to %d epochs...\n", max_epochs);
-#endif
+static struct ann_shm_group *ann_checkshm(lua_State *L, int idx)
+{
+	struct ann_shm_group *g;
 
-	fann_train_on_data(*ann, *train, max_epochs, epochs_between_reports, desired_error);
-	return 0;
+	g = luaL_checkudata(L, idx, FANN_SHM_METATABLE);
+	luaL_argcheck(L, g != NULL, idx, "'process group' expected");
+	if(!g->shm)
+		luaL_error(L, "process group is closed");
+	return g;
 }
 
-/*! train:save(filename)
- *# Saves training data to a specified file
- *x train:save("train.data")
+/*! fann.shm_group(name, workers, rank, [max_connections], [timeout])
+ *# Joins the process group {{name}} (a POSIX shared memory name such as
+ *# {{"/xor"}}) of {{workers}} processes as worker {{rank}}, counting from
+ *# 0. Worker 0 creates the shared memory segment, sized for networks of up
+ *# to {{max_connections}} connections (default 65536), replacing one left
+ *# over by a crashed group but never one of a running group. The other
+ *# workers wait up to {{timeout}} seconds (default 30) for it to appear.
+ *# During training, workers wait for each other as long as it takes, but
+ *# give up with an error once a worker has died, or has not joined the
+ *# group within {{timeout}} seconds.
+ *x group = fann.shm_group("/xor", 4, rank)
  *-
  */
-static int ann_save_train(lua_State *L)
+static int ann_shm_create(lua_State *L)
 {
-	struct fann_train_data **train;
-	const char *fname;
-
-	if(lua_gettop(L) < 2)
-		luaL_error(L, "insufficient parameters");
-
-	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
-	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+	struct ann_shm_group *g;
+	struct ann_shm_header *h;
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	const char *name;
+	int nworkers, rank, max_connections, timeout, fd, tries;
+	size_t size;
+	void *mem;
+
+	name = luaL_checkstring(L, 1);
+	nworkers = luaL_checkinteger(L, 2);
+	rank = luaL_checkinteger(L, 3);
+	max_connections = luaL_optinteger(L, 4, 65536);
+	timeout = luaL_optinteger(L, 5, 30);
+	luaL_argcheck(L, nworkers > 0, 2, "a group needs at least one worker");
+	luaL_argcheck(L, rank >= 0 && rank < nworkers, 3, "rank out of range");
+	luaL_argcheck(L, max_connections > 0, 4, "max_connections must be positive");
+	luaL_argcheck(L, timeout > 0, 5, "timeout must be positive");
+
+	g = lua_newuserdata(L, sizeof *g);
+	memset(g, 0, sizeof *g);
+	luaL_getmetatable(L, FANN_SHM_METATABLE);
+	lua_setmetatable(L, -2);
 
-	fname = lua_tostring(L, 2);
+	g->nworkers = nworkers;
+	g->rank = rank;
+	g->timeout = timeout;
+	g->slot_size = sizeof(struct ann_shm_slot) + max_connections*sizeof(fann_type);
+	g->slot_size = (g->slot_size + 7) & ~(size_t)7;
+	g->size = sizeof *h + nworkers*g->slot_size;
+	g->name = malloc(strlen(name) + 1);
+	if(!g->name)
+		luaL_error(L, "out of memory");
+	strcpy(g->name, name);
 
 #ifdef FANN_VERBOSE
-	printf("Saving training data to %s\n", fname);
+	printf("Joining process group %s as worker %d of %d\n", name, rank, nworkers);
 #endif
-	fann_save_train(*train, fname);
-	return 0;
+
+	if(rank == 0)
+	{
+		for(tries = 0; (fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0; tries++)
+		{
+			if(errno != EEXIST || tries >= timeout*10)
+				luaL_error(L, "Unable to create shared memory %s: %s", name, strerror(errno));
+			if((h = ann_shm_attach(name, &size)))
+			{
+				munmap(h, size);
+				luaL_error(L, "process group %s is already running", name);
+			}
+			/* Left over by a crashed group, unless another worker 0 is just
+			 * setting it up: look once more before replacing it */
+			if(tries)
+				shm_unlink(name);
+			else
+				nanosleep(&ann_shm_poll, NULL);
+		}
+
+		if(ftruncate(fd, g->size))
+		{
+			close(fd);
+			shm_unlink(name);
+			luaL_error(L, "Unable to create shared memory %s: %s", name, strerror(errno));
+		}
+		mem = mmap(NULL, g->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if(mem == MAP_FAILED)
+		{
+			shm_unlink(name);
+			luaL_error(L, "Unable to map shared memory %s: %s", name, strerror(errno));
+		}
+		h = mem;
+
+		pthread_mutexattr_init(&mattr);
+		pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&h->lock, &mattr);
+		pthread_mutexattr_destroy(&mattr);
+		pthread_condattr_init(&cattr);
+		pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+		pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+		pthread_cond_init(&h->cond, &cattr);
+		pthread_condattr_destroy(&cattr);
+		h->nworkers = nworkers;
+		h->type_size = sizeof(fann_type);
+		h->max_connections = max_connections;
+		h->owner = getpid();
+		__sync_synchronize();
+		memcpy(h->magic, ANN_SHM_MAGIC, sizeof h->magic);
+	}
+	else
+	{
+		/* Wait for worker 0 to set the segment up, skipping one left over
+		 * by a crashed group until worker 0 replaces it */
+		for(tries = 0; !(h = ann_shm_attach(name, &size)); tries++)
+		{
+			if(tries >= timeout*10)
+				luaL_error(L, "Shared memory %s was not set up by worker 0", name);
+			nanosleep(&ann_shm_poll, NULL);
+		}
+		if(size != g->size || h->nworkers != (uint32_t)nworkers || h->type_size != sizeof(fann_type)
+		   || h->max_connections != (uint32_t)max_connections)
+		{
+			munmap(h, size);
+			luaL_error(L, "Shared memory %s belongs to a different group", name);
+		}
+	}
+	g->shm = h;
+	ann_shm_slot(g, rank)->pid = getpid();
+
+	return 1;
 }
 
-/*! train:scale_input(min, max)
- *# Scales the inputs of training data  to the new range [{{min}}-{{max}}]
- *x
+/*! ann:train_parallel(group, train, max_epochs, desired_error)
+ *# Trains the network in the process group {{group}} on this worker's
+ *# shard {{train}} of the training data (see {{train:shard()}}). Every
+ *# worker must call it with the same network topology, training parameters
+ *# and limits. Worker 0's weights are copied to every worker first. Each
+ *# epoch trains every copy on its shard with the network's training
+ *# algorithm, then sets every copy to the average of their weights,
+ *# weighted by the number of samples in each shard. Training stops after
+ *# {{max_epochs}} epochs or once the error over all shards reaches
+ *# {{desired_error}}. Returns the number of epochs and the final MSE.
+ *x epochs, mse = ann:train_parallel(group, train:shard(rank, 4), 1000, 0.001)
  *-
  */
-static int ann_train_scale_input(lua_State *L)
+static int ann_train_parallel(lua_State *L)
 {
+	struct fann **ann;
 	struct fann_train_data **train;
-	fann_type min, max;
+	struct ann_shm_group *g;
+	struct ann_shm_slot *slot;
+	struct fann *a;
+	unsigned int n, max_epochs, epoch, r;
+	float desired_error;
+	double mse;
+	lua_Integer epochs;
 
-	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
-	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+	if(lua_gettop(L) < 5)
+		luaL_error(L, "insufficient parameters");
 
-	min = luaL_checknumber(L, 2);
-	max = luaL_checknumber(L, 3);
+	ann = luaL_checkudata(L, 1, FANN_METATABLE);
+	luaL_argcheck(L, ann != NULL, 1, "'neural net' expected");
+	g = ann_checkshm(L, 2);
+	train = luaL_checkudata(L, 3, FANN_TRAIN_METATABLE);
+	luaL_argcheck(L, train != NULL, 3, "'training data' expected");
+	epochs = luaL_checkinteger(L, 4);
+	luaL_argcheck(L, epochs >= 1 && epochs <= UINT_MAX, 4, "max_epochs must be positive");
+	max_epochs = epochs;
+	desired_error = luaL_checknumber(L, 5);
+
+	a = *ann;
+	n = a->total_connections;
+	if(n > g->shm->max_connections)
+		luaL_error(L, "network has more connections than the group was created for");
+	if((*train)->num_input != fann_get_num_input(a) || (*train)->num_output != fann_get_num_output(a))
+		luaL_error(L, "training data does not match the network");
 
 #ifdef FANN_VERBOSE
-	printf("Scaling training data inputs to %g - %g\n", (double)min, (double)max);
+	printf("Training in parallel as worker %d of %d\n", g->rank, g->nworkers);
 #endif
 
-	fann_scale_input_train_data(*train, min, max);
+	/* Start from worker 0's weights */
+	if(g->rank == 0)
+		memcpy(ann_shm_values(g, 0), a->weights, n*sizeof(fann_type));
+	ann_shm_barrier(L, g);
+	memcpy(a->weights, ann_shm_values(g, 0), n*sizeof(fann_type));
+	ann_shm_barrier(L, g);
 
-	return 0;
+	mse = 0;
+	for(epoch = 0; epoch < max_epochs; )
+	{
+		fann_train_epoch(a, *train);
+
+		slot = ann_shm_slot(g, g->rank);
+		slot->mse = a->MSE_value;
+		slot->num_mse = a->num_MSE;
+		slot->bit_fail = a->num_bit_fail;
+		slot->num_data = (*train)->num_data;
+		memcpy(ann_shm_values(g, g->rank), a->weights, n*sizeof(fann_type));
+		ann_shm_barrier(L, g);
+
+		ann_shm_average(g, a->weights, n);
+		a->MSE_value = 0;
+		a->num_MSE = a->num_bit_fail = 0;
+		for(r = 0; r < g->nworkers; r++)
+		{
+			slot = ann_shm_slot(g, r);
+			a->MSE_value += slot->mse;
+			a->num_MSE += slot->num_mse;
+			a->num_bit_fail += slot->bit_fail;
+		}
+		/* Nobody may overwrite a slot before everyone has read it */
+		ann_shm_barrier(L, g);
+
+		epoch++;
+		mse = fann_get_MSE(a);
+		if(ann_desired_error_reached(a, desired_error))
+			break;
+	}
+
+	lua_pushinteger(L, epoch);
+	lua_pushnumber(L, mse);
+	return 2;
 }
 
-/*! train:scale_output(min, max)
- *# Scales the outputs of training data to the new range [{{min}}-{{max}}]
- *x
+/*! group:close()
+ *# Leaves the process group. Worker 0 also removes the shared memory
+ *# segment's name. Also called when the group is garbage collected.
+ *x group:close()
  *-
  */
-static int ann_train_scale_output(lua_State *L)
+static int ann_shm_close(lua_State *L)
 {
-	struct fann_train_data **train;
-	fann_type min, max;
-
-	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
-	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
+	struct ann_shm_group *g;
 
-	min = luaL_checknumber(L, 2);
-	max = luaL_checknumber(L, 3);
+	g = luaL_checkudata(L, 1, FANN_SHM_METATABLE);
+	luaL_argcheck(L, g != NULL, 1, "'process group' expected");
 
-#ifdef FANN_VERBOSE
-	printf("Scaling training data outputs to %g - %g\n", (double)min, (double)max);
-#endif
-	fann_scale_output_train_data(*train, min, max);
+	if(g->shm)
+	{
+		munmap(g->shm, g->size);
+		g->shm = NULL;
+		if(g->rank == 0)
+			shm_unlink(g->name);
+	}
+	free(g->name);
+	g->name = NULL;
 
 	return 0;
 }
 
-/*! train:scale(min, max)
- *# Scales the inputs and outputs of training data to the new range [{{min}}-{{max}}]
- *x
+/*! group:__tostring()
+ *# Converts a process group to a string for Lua's virtual machine
+ *x print(group)
  *-
  */
-static int ann_train_scale(lua_State *L)
+static int ann_shm_tostring(lua_State *L)
 {
-	struct fann_train_data **train;
-	fann_type min, max;
-
-	train = luaL_checkudata(L, 1, FANN_TRAIN_METATABLE);
-	luaL_argcheck(L, train != NULL, 1, "'training data' expected");
-
-	min = luaL_checknumber(L, 2);
-	max = luaL_checknumber(L, 3);
-
-#ifdef FANN_VERBOSE
-	printf("Scaling training data to %g - %g\n", (double)min, (double)max);
-#endif
+	struct ann_shm_group *g;
 
-	fann_scale_train_data(*train, min, max);
+	g = luaL_checkudata(L, 1, FANN_SHM_METATABLE);
+	luaL_argcheck(L, g != NULL, 1, "'process group' expected");
 
-	return 0;
+	if(!g->shm)
+		lua_pushliteral(L, "[[FANN process group: closed]]");
+	else
+		lua_pushfstring(L, "[[FANN process group: %s, worker %d of %d]]", g->name, g->rank, g->nworkers);
+	return 1;
 }
+#endif
 
 /* ************************************************************************** */
 
@@ -944,12 +7207,38 @@ static const struct luaL_Reg fann_lib_members[] = {
   {"set_activation_steepness_output", ann_set_activation_steepness_output},
   {"set_train_stop_function", ann_set_train_stop_function},
   {"set_bit_fail_limit", ann_set_bit_fail_limit},
+#ifndef FIXEDFANN
   {"train_on_file", ann_train_on_file},
   {"train_on_data", ann_train_on_data},
+  {"train", ann_train},
+  {"train_batch", ann_train_batch},
+  {"train_job", ann_train_job_create},
+  {"train_checkpointed", ann_train_checkpointed},
+  {"resume_training", ann_resume_training},
+  {"train_minibatch", ann_train_minibatch},
+  {"train_sampled", ann_train_sampled},
+  {"train_on_generator", ann_train_on_generator},
+  {"train_parallel", ann_train_parallel},
+#endif
+  {"queue", ann_queue_create},
+#ifndef FIXEDFANN
   {"init_weights", ann_init_weights},
+  {"set_scaling", ann_set_scaling},
+  {"scale_input", ann_scale_input},
+  {"descale_output", ann_descale_output},
+  {"save_to_fixed", ann_save_to_fixed},
+#endif
   {"test_data", ann_test_data},
+  {"evaluate", ann_evaluate},
   {"save", ann_save},
   {"run", ann_run},
+  {"run_packed", ann_run_packed},
+  {"run_packed_batch", ann_run_packed_batch},
+  {"classify", ann_classify},
+  {"classify_batch", ann_classify_batch},
+  {"stream", ann_stream_create},
+  {"record", ann_record},
+  {"handle", ann_handle},
   {NULL, NULL}
 };
 
@@ -957,12 +7246,92 @@ static const struct luaL_Reg fann_train_lib_members[] = {
   {"__gc", ann_train_close},
   {"__tostring", ann_train_tostring},
   {"save", ann_save_train},
+#ifndef FIXEDFANN
   {"scale_input", ann_train_scale_input},
   {"scale_output", ann_train_scale_output},
   {"scale", ann_train_scale},
+#endif
+  {"shard", ann_train_shard},
+  {"stats", ann_train_stats},
+#ifndef FIXEDFANN
+  {"standardize", ann_train_standardize},
+  {"normalize", ann_train_normalize},
+#endif
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg fann_queue_lib_members[] = {
+  {"__gc", ann_queue_close},
+  {"__tostring", ann_queue_tostring},
+  {"poll", ann_queue_poll},
+  {"pending", ann_queue_pending},
+  {"close", ann_queue_close},
+  {NULL, NULL}
+};
+
+#ifndef FIXEDFANN
+static const struct luaL_Reg fann_train_job_lib_members[] = {
+  {"__gc", ann_train_job_close},
+  {"__tostring", ann_train_job_tostring},
+  {"step", ann_train_job_step},
+#if LUA_VERSION_NUM > 501
+  {"run", ann_train_job_run},
+#endif
+  {NULL, NULL}
+};
+#endif
+
+static const struct luaL_Reg fann_model_lib_members[] = {
+  {"__gc", ann_model_close},
+  {"__tostring", ann_model_tostring},
+  {"run", ann_model_run},
+  {"version", ann_model_version},
+  {"close", ann_model_close},
+  {NULL, NULL}
+};
+
+static const struct luaL_Reg fann_shared_lib_members[] = {
+  {"__gc", ann_shared_close},
+  {"__tostring", ann_shared_tostring},
+  {"run", ann_shared_run},
+  {"close", ann_shared_close},
+  {NULL, NULL}
+};
+
+#ifndef FIXEDFANN
+static const struct luaL_Reg fann_generator_lib_members[] = {
+  {"__gc", ann_generator_gc},
+  {"__tostring", ann_generator_tostring},
+  {NULL, NULL}
+};
+#endif
+
+static const struct luaL_Reg fann_stream_lib_members[] = {
+  {"__gc", ann_stream_gc},
+  {"__tostring", ann_stream_tostring},
+  {"push", ann_stream_push},
+  {"push_many", ann_stream_push_many},
+  {"reset", ann_stream_reset},
   {NULL, NULL}
 };
 
+static const struct luaL_Reg fann_pipeline_lib_members[] = {
+  {"__gc", ann_pipeline_gc},
+  {"__tostring", ann_pipeline_tostring},
+  {"run", ann_pipeline_run},
+  {"run_batch", ann_pipeline_run_batch},
+  {NULL, NULL}
+};
+
+#ifndef FIXEDFANN
+static const struct luaL_Reg fann_shm_lib_members[] = {
+  {"__gc", ann_shm_close},
+  {"__tostring", ann_shm_tostring},
+  {"close", ann_shm_close},
+  {NULL, NULL}
+};
+#endif
+
 struct iglobal { char *name; int value; };
 
 /*h Constants
@@ -975,6 +7344,17 @@ static const struct luaL_Reg fann_lib[] = {
   {"create_sparse", ann_create_sparse},
   {"create_from_file", ann_create_from_file},
   {"read_train_from_file", ann_read_train_from_file},
+  {"watch", ann_model_create},
+  {"share", ann_shared_create},
+  {"unshare", ann_shared_remove},
+#ifndef FIXEDFANN
+  {"train_generator", ann_generator_create},
+#endif
+  {"pipeline", ann_pipeline_create},
+  {"replay", ann_replay},
+#ifndef FIXEDFANN
+  {"shm_group", ann_shm_create},
+#endif
   {NULL, NULL}
 };
 
@@ -1037,6 +7417,9 @@ static const struct iglobal fann_activation_functions [] = {
 	/** {{fann.FANN_TRAIN_QUICKPROP}}
 	 */
 	{"FANN_TRAIN_QUICKPROP", 	FANN_TRAIN_QUICKPROP},
+	/** {{fann.FANN_TRAIN_SARPROP}}
+	 */
+	{"FANN_TRAIN_SARPROP", 	FANN_TRAIN_SARPROP},
 
 	/* FANN 2.1 defines some more, but I'm sticking with 2.0 for now */
 	/*}*/
@@ -1055,7 +7438,15 @@ static const struct iglobal fann_activation_functions [] = {
 	{NULL, 0}
 };
 
+#if defined(FIXEDFANN)
+LUALIB_API int luaopen_fann_fixed(lua_State *L)
+#elif defined(DOUBLEFANN)
+LUALIB_API int luaopen_fann_double(lua_State *L)
+#elif defined(FLOATFANN)
+LUALIB_API int luaopen_fann_float(lua_State *L)
+#else
 LUALIB_API int luaopen_fann(lua_State *L)
+#endif
 {
 	const struct iglobal *i;
 
@@ -1081,6 +7472,76 @@ LUALIB_API int luaopen_fann(lua_State *L)
 	lua_settable(L, -3);
 	luaL_setfuncs(L, fann_train_lib_members, 0);
 
+	luaL_newmetatable(L, FANN_QUEUE_METATABLE);
+	lua_pushstring(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_settable(L, -3);
+	luaL_setfuncs(L, fann_queue_lib_members, 0);
+	luaL_loadstring(L, ann_queue_run_lua);
+	lua_pushcfunction(L, ann_queue_submit);
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, FANN_QUEUE_PARKED);
+	lua_call(L, 2, 1);
+	lua_setfield(L, -2, "run");
+
+#ifndef FIXEDFANN
+	luaL_newmetatable(L, FANN_TRAIN_JOB_METATABLE);
+	lua_pushstring(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_settable(L, -3);
+	luaL_setfuncs(L, fann_train_job_lib_members, 0);
+#if LUA_VERSION_NUM <= 501
+	luaL_loadstring(L, ann_train_job_run_lua);
+	lua_call(L, 0, 1);
+	lua_setfield(L, -2, "run");
+#endif
+#endif
+
+	luaL_newmetatable(L, FANN_MODEL_METATABLE);
+	lua_pushstring(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_settable(L, -3);
+	luaL_setfuncs(L, fann_model_lib_members, 0);
+
+	luaL_newmetatable(L, FANN_SHARED_METATABLE);
+	lua_pushstring(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_settable(L, -3);
+	luaL_setfuncs(L, fann_shared_lib_members, 0);
+
+#ifndef FIXEDFANN
+	luaL_newmetatable(L, FANN_GENERATOR_METATABLE);
+	lua_pushstring(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_settable(L, -3);
+	luaL_setfuncs(L, fann_generator_lib_members, 0);
+#endif
+
+	luaL_newmetatable(L, FANN_STREAM_METATABLE);
+	lua_pushstring(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_settable(L, -3);
+	luaL_setfuncs(L, fann_stream_lib_members, 0);
+
+	luaL_newmetatable(L, FANN_PIPELINE_METATABLE);
+	lua_pushstring(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_settable(L, -3);
+	luaL_setfuncs(L, fann_pipeline_lib_members, 0);
+
+#ifndef FIXEDFANN
+	luaL_newmetatable(L, FANN_SHM_METATABLE);
+	lua_pushstring(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_settable(L, -3);
+	luaL_setfuncs(L, fann_shm_lib_members, 0);
+#endif
+
 //	lua_newtable(L);
 //	luaL_setfuncs(L, fann_lib, 0);
 	luaL_newlib(L, fann_lib);
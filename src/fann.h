@@ -23,9 +23,69 @@
 
 #include <lua.h>
 #include <lauxlib.h>
+#include <stddef.h>
 
 
 LUALIB_API int luaopen_fann(lua_State *L);
+LUALIB_API int luaopen_fann_float(lua_State *L);
+LUALIB_API int luaopen_fann_double(lua_State *L);
+LUALIB_API int luaopen_fann_fixed(lua_State *L);
 #if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
 LUALIB_API void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup);
 #endif
+
+/*
+ *	C producers for fann.train_generator()
+ *
+ *	A producer fills batch->input (rows x num_input values) and batch->output
+ *	(rows x num_output values), both row major arrays of the fann_type the
+ *	module was built with, and returns the number of rows it filled, at most
+ *	batch->rows; 0 ends the data. Producers run on a background thread and
+ *	must not call into Lua.
+ *
+ *	The fixed point module, fann.fixed, does no training and has no producers.
+ */
+
+struct luafann_batch
+{
+	unsigned int rows;
+	unsigned int num_input, num_output;
+	size_t type_size;
+	void *input, *output;
+};
+
+typedef unsigned int (*luafann_producer)(void *ud, struct luafann_batch *batch);
+
+/* Registers fn under name for every Lua state in the process, replacing any
+ * producer registered under name before; a NULL fn removes it. Returns 0 on
+ * success. */
+LUALIB_API int luafann_register_producer(const char *name, luafann_producer fn, void *ud);
+
+/*
+ *	Plain C functions evaluating a network, for LuaJIT's FFI
+ *
+ *	handle is the network as returned by ann:handle(). The inputs and outputs
+ *	are arrays of floats, converted to and from the fann_type the module was
+ *	built with (scaled by the network's multiplier in fixed point builds);
+ *	luafann_run_batch() takes rows of inputs and gives rows of
+ *	outputs back to back. Both return nonzero without touching the outputs
+ *	once the network is closed. ann:handle() also returns the address of a
+ *	struct luafann_abi holding the functions of the module that made the
+ *	handle.
+ */
+
+#define LUAFANN_ABI_VERSION 1
+
+LUALIB_API unsigned int luafann_num_input(void *handle);
+LUALIB_API unsigned int luafann_num_output(void *handle);
+LUALIB_API int luafann_run(void *handle, const float *input, float *output);
+LUALIB_API int luafann_run_batch(void *handle, unsigned int rows, const float *input, float *output);
+
+struct luafann_abi
+{
+	unsigned int version;
+	unsigned int (*num_input)(void *handle);
+	unsigned int (*num_output)(void *handle);
+	int (*run)(void *handle, const float *input, float *output);
+	int (*run_batch)(void *handle, unsigned int rows, const float *input, float *output);
+};
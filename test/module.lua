@@ -55,3 +55,322 @@ test = fann.read_train_from_file("xortest.data")
 print("Test data read: " .. test:__tostring())
 mse = ann:test_data(test)
 print("MSE on test data: " .. mse)
+
+-- Keep the network up to date with a few samples of live feedback
+ann:train({-1, 1}, {1})
+mse = ann:train_batch({{-1, -1}, {1, 1}}, {{-1}, {-1}})
+print("MSE on feedback batch: " .. mse)
+
+-- Evaluate samples submitted from coroutines in micro-batches
+q = ann:queue(4, 200, 2)
+for _, v in ipairs({{1, 1}, {1, -1}}) do
+	coroutine.wrap(function()
+		print("Queued result: " .. q:run(v[1], v[2]))
+	end)()
+end
+q:poll(true)
+print("Blocking queue result: " .. q:run(-1, 1))
+coroutine.wrap(function()
+	local ok, out = pcall(q.run, q, -1, -1)
+	assert(ok, out)
+	print("Queued result inside pcall: " .. out)
+end)()
+q:poll(true)
+assert(q:pending() == 0)
+-- A coroutine resumed by anything but q:poll() stops waiting on the queue
+co = coroutine.create(function() return q:run(1, 1) end)
+assert(coroutine.resume(co))
+assert(not coroutine.resume(co, "not from the queue"))
+assert(q:poll(true) == 0)
+q:close()
+
+-- Retrain in slices from a coroutine, yielding to the host in between
+job = ann:train_job(train, 2000, 100, 0.001)
+co = coroutine.create(function() return job:run() end)
+repeat
+	ok, epochs, mse = coroutine.resume(co)
+	assert(ok, epochs)
+until coroutine.status(co) == "dead"
+print("Retrained for " .. epochs .. " epochs, MSE: " .. mse)
+assert(not pcall(ann.train_job, ann, train, -1, 100, 0.001))
+
+-- Gather evaluation metrics in one pass over the test data
+metrics = ann:evaluate(test, {threads = 2})
+print("Evaluation: MSE " .. metrics.mse .. ", bit fails " .. metrics.bit_fail ..
+      ", accuracy " .. metrics.accuracy)
+
+-- Follow a network file on disk, picking up new versions as they appear
+model = fann.watch("myxor.net", 100)
+print("Watched model v" .. model:version() .. ": " .. model:run(1, -1))
+model:close()
+
+-- Evaluate a network registered once for every Lua state in the process
+shared = fann.share("xor", ann)
+print("Shared result: " .. shared:run(-1, -1))
+print("Shared again: " .. fann.share("xor"):run(1, 1))
+fann.unshare("xor")
+
+-- Train with checkpoints, stop early, then resume the run from its last
+-- checkpoint; it must end where an uninterrupted run does
+for _, algorithm in ipairs{fann.FANN_TRAIN_SARPROP, fann.FANN_TRAIN_RPROP} do
+	ann = fann.create_standard(3, 2, 2, 1)
+	ann:set_activation_function_hidden(fann.FANN_SIGMOID_SYMMETRIC)
+	ann:set_activation_function_output(fann.FANN_SIGMOID_SYMMETRIC)
+	ann:set_training_algorithm(algorithm)
+	ann:save("untrained.net")
+	epochs, mse = ann:train_checkpointed(train, 50, 0, "xor.ckpt", 20)
+	print("Checkpointed after " .. epochs .. " epochs, MSE: " .. mse)
+	assert(epochs == 50)
+	ann = fann.create_from_file("untrained.net")
+	epochs, mse = ann:resume_training("xor.ckpt", train, 120)
+	print("Resumed to epoch " .. epochs .. ", MSE: " .. mse)
+	assert(epochs == 120)
+	whole = fann.create_from_file("untrained.net")
+	epochs, whole_mse = whole:train_checkpointed(train, 120, 0, "whole.ckpt", 0)
+	print("Uninterrupted after " .. epochs .. " epochs, MSE: " .. whole_mse)
+	assert(math.abs(mse - whole_mse) < 1e-6)
+end
+assert(not pcall(ann.train_checkpointed, ann, train, -1, 0, "xor.ckpt", 0))
+assert(not pcall(ann.train_checkpointed, ann, train, 10, 0, "xor.ckpt", -1))
+
+-- Train a fresh network with mini-batch Adam
+ann = fann.create_standard(3, 2, 4, 1)
+ann:set_activation_function_hidden(fann.FANN_SIGMOID_SYMMETRIC)
+ann:set_activation_function_output(fann.FANN_SIGMOID_SYMMETRIC)
+epochs, mse = ann:train_minibatch(train, 5000, 0.001, {optimizer = "adam", batch = 2, learning_rate = 0.01})
+print("Mini-batch Adam after " .. epochs .. " epochs, MSE: " .. mse)
+assert(not pcall(ann.train_minibatch, ann, train, -1, 0.001))
+print("Mini-batch result: " .. ann:run(1, -1))
+
+-- Standardize a copy of the data, and store the transform with the network
+data = fann.read_train_from_file("xor.data")
+stats = data:stats({threads = 2})
+print("Input 1: mean " .. stats.input.mean[1] .. ", variance " .. stats.input.variance[1])
+data:standardize(stats)
+ann:set_scaling(stats)
+print("Scaled input: " .. table.concat(ann:scale_input({1, -1}), ", "))
+
+-- Standardize columns that are not centred yet, and check the result
+f = assert(io.open("skewed.data", "w"))
+f:write("5 2 1\n3 10\n1\n5 20\n0\n6 25\n1\n10 40\n0\n11 55\n1\n")
+f:close()
+data = fann.read_train_from_file("skewed.data")
+stats = data:standardize()
+standard = data:stats()
+for i = 1, 2 do
+	assert(math.abs(stats.input.mean[i]) > 1 and math.abs(stats.input.variance[i] - 1) > 1)
+	assert(math.abs(standard.input.mean[i]) < 1e-6)
+	assert(math.abs(standard.input.variance[i] - 1) < 1e-5)
+end
+ann:set_scaling(stats)
+data:save("skewed_standard.data")
+f = assert(io.open("skewed_standard.data"))
+f:read("*l")
+row = {}
+for x in f:read("*l"):gmatch("%S+") do row[#row + 1] = tonumber(x) end
+f:close()
+scaled = ann:scale_input({3, 10})
+for i = 1, 2 do assert(math.abs(scaled[i] - row[i]) < 1e-4) end
+ok, err = pcall(ann.set_scaling, ann, stats, {method = "zscore"})
+assert(not ok and err:find("options.method", 1, true))
+
+-- Train on samples drawn by their last error
+ann = fann.create_from_file("untrained.net")
+epochs, mse, evaluations = ann:train_sampled(train, 5000, 0.001, {floor = 0.2, fraction = 0.5, seed = 42})
+print("Sampled training after " .. epochs .. " epochs, " .. evaluations .. " samples, MSE: " .. mse)
+assert(epochs == 5000 or mse <= 0.001)
+-- Full incremental epochs from the same weights, each training on and then
+-- testing the 4 samples of xor.data, must evaluate more to reach that MSE
+full = fann.create_from_file("untrained.net")
+full:set_training_algorithm(fann.FANN_TRAIN_INCREMENTAL)
+full_evaluations = 0
+repeat
+	full:train_on_data(train, 1, 0, 0)
+	full_evaluations = full_evaluations + 8
+until full:test_data(train) <= mse or full_evaluations >= 5000*8
+print("Full epochs evaluated " .. full_evaluations .. " samples")
+assert(evaluations <= full_evaluations)
+assert(not pcall(ann.train_sampled, ann, train, -1, 0.001))
+assert(not pcall(ann.train_sampled, ann, train, 10, 0.001, {seed = -1}))
+
+-- Train on batches produced on the fly while the previous batch trains
+remaining = 200
+gen = fann.train_generator(function(n)
+	if remaining == 0 then return nil end
+	remaining = remaining - 1
+	local a, b = math.random(0, 1) * 2 - 1, math.random(0, 1) * 2 - 1
+	return {{a, b}}, {{a == b and -1 or 1}}
+end, 1, {prefetch = 2})
+batches, mse = ann:train_on_generator(gen, 1000)
+print("Trained on " .. batches .. " generated batches, MSE: " .. mse)
+assert(not pcall(ann.train_on_generator, ann, gen, -1))
+
+-- Evaluate inputs packed as binary floats, without unpacking them in Lua.
+-- string.pack only exists from Lua 5.3 on; elsewhere the values are packed
+-- by hand as little-endian IEEE 754 ("f" when size is 4, "d" when it is 8)
+local function packnum(x, size)
+	local mbits, bias = size == 4 and 23 or 52, size == 4 and 127 or 1023
+	local sign, e, m, bytes, r = 0, 0, 0, {}, mbits % 8
+	if x < 0 then sign, x = 1, -x end
+	if x ~= 0 then
+		m, e = math.frexp(x)
+		m, e = math.floor((m*2 - 1)*2^mbits + 0.5), e - 1 + bias
+	end
+	for i = 1, (mbits - r)/8 do
+		bytes[i] = m % 256
+		m = math.floor(m/256)
+	end
+	bytes[#bytes + 1] = m + (e % 2^(8 - r))*2^r
+	bytes[#bytes + 1] = math.floor(e/2^(8 - r)) + sign*128
+	return string.char((unpack or table.unpack)(bytes))
+end
+
+local function unpacknum(s, size, pos)
+	local mbits, bias = size == 4 and 23 or 52, size == 4 and 127 or 1023
+	local r, m = mbits % 8, 0
+	local b = {s:byte(pos or 1, (pos or 1) + size - 1)}
+	for i = size - 2, 1, -1 do
+		m = m*256 + b[i]
+	end
+	m = m + (b[size - 1] % 2^r)*2^(mbits - r)
+	local e = math.floor(b[size - 1]/2^r) + (b[size] % 128)*2^(8 - r)
+	local x = e == 0 and 0 or (1 + m/2^mbits)*2^(e - bias)
+	return b[size] >= 128 and -x or x
+end
+
+if string.pack then
+	packnum = function(x, size) return string.pack(size == 4 and "=f" or "=d", x) end
+	unpacknum = function(s, size, pos) return (string.unpack(size == 4 and "=f" or "=d", s, pos)) end
+end
+
+local function pack(size, ...)
+	local t = {}
+	for i = 1, select("#", ...) do
+		t[i] = packnum(select(i, ...), size)
+	end
+	return table.concat(t)
+end
+
+out = ann:run_packed(pack(4, 1, -1))
+print("Packed result: " .. unpacknum(out, 4))
+assert(#out == 4 and math.abs(unpacknum(out, 4) - ann:run(1, -1)) < 1e-6)
+out = ann:run_packed_batch(pack(8, -1, -1, 1, -1), 2, nil, nil, "double")
+print("Packed batch results: " .. unpacknum(out, 8) .. ", " .. unpacknum(out, 8, 9))
+assert(#out == 16)
+assert(math.abs(unpacknum(out, 8) - ann:run(-1, -1)) < 1e-6)
+assert(math.abs(unpacknum(out, 8, 9) - ann:run(1, -1)) < 1e-6)
+
+-- Reduce the outputs to the best class in C
+class, score = ann:classify({1, -1})
+print("Class " .. class .. ", score " .. score)
+classes, scores = ann:classify_batch({{-1, -1}, {1, -1}}, 1, true)
+print("Top classes: " .. classes[1][1] .. ", " .. classes[2][1])
+assert(not pcall(ann.classify, ann, {1, -1}, -1))
+assert(not pcall(ann.classify_batch, ann, {{1, -1}}, -1))
+
+-- Slide a window of the last two samples of a signal over the network
+stream = ann:stream(1)
+print("Stream warming up: " .. select("#", stream:push(-1)) .. " outputs")
+print("Stream result: " .. stream:push(1))
+outs = stream:push_many({1, -1, -1})
+print("Stream block results: " .. table.concat(outs, ", "))
+stream:reset()
+
+-- Chain networks in C: the XOR net feeds a gate choosing between two experts
+gate = fann.create_standard(2, 1, 2)
+expert1 = fann.create_standard(2, 2, 1)
+expert2 = fann.create_standard(2, 2, 1)
+pipeline = fann.pipeline{
+	{net = ann},
+	{net = gate, inputs = {1}},
+	{experts = {expert1, expert2}, gate = 2, inputs = {1, {0, 2, 1}}},
+}
+print(pipeline)
+print("Pipeline result: " .. pipeline:run(1, -1))
+print("Pipeline batch: " .. #pipeline:run_batch({{-1, -1}, {1, 1}}) .. " rows")
+
+-- Train data parallel with a second worker process over shared memory
+ann = fann.create_standard(3, 2, 2, 1)
+ann:set_activation_function_hidden(fann.FANN_SIGMOID_SYMMETRIC)
+ann:set_activation_function_output(fann.FANN_SIGMOID_SYMMETRIC)
+ann:save("parallel.net")
+worker = arg and arg[-1] and io.popen(arg[-1] .. [[ -e '
+	local fann = require "fann"
+	local ann = fann.create_from_file("parallel.net")
+	local group = fann.shm_group("/luafann-xor", 2, 1, nil, 10)
+	ann:train_parallel(group, fann.read_train_from_file("xor.data"):shard(1, 2), 500, 0.0001)
+	group:close()']])
+group = fann.shm_group("/luafann-xor", worker and 2 or 1, 0, nil, 10)
+epochs, mse = ann:train_parallel(group, train:shard(0, worker and 2 or 1), 500, 0.0001)
+print("Parallel training: " .. epochs .. " epochs, MSE: " .. mse)
+assert(not pcall(ann.train_parallel, ann, group, train, -1, 0.0001))
+if worker then worker:close() end
+group:close()
+
+-- The precision variants, when built with "make variants", load side by side
+-- and all take and return real values: the fixed point XOR net agrees with
+-- the one it was saved from
+xor = fann.create_from_file("myxor.net")
+xor:save_to_fixed("myxor_fixed.net")
+for variant, file in pairs{["fann.float"] = "myxor.net", ["fann.double"] = "myxor.net",
+		["fann.fixed"] = "myxor_fixed.net"} do
+	local ok, vfann = pcall(require, variant)
+	if ok then
+		local net = vfann.create_from_file(file)
+		print(variant .. ": " .. net:run(1, -1))
+		for _, v in ipairs{{-1, -1}, {-1, 1}, {1, -1}, {1, 1}} do
+			assert(math.abs(net:run(v[1], v[2]) - xor:run(v[1], v[2])) < 0.05)
+		end
+	end
+end
+
+-- Record the inputs the XOR net is run on, and replay them as fast as possible
+ann = fann.create_from_file("myxor.net")
+ann:record("xor.trace")
+for i = 1, 100 do ann:run(i % 2 == 0 and 1 or -1, i % 3 == 0 and 1 or -1) end
+ann:classify_batch({{-1, -1}, {-1, 1}, {1, -1}, {1, 1}})
+calls, rows = ann:record()
+print("Recorded " .. calls .. " calls, " .. rows .. " rows")
+assert(calls == 101 and rows == 104)
+stats = fann.replay(ann, "xor.trace")
+print(string.format("Replay: %d calls/s, p50 %.1f us, p99 %.1f us", stats.calls_per_second, stats.p50*1e6, stats.p99*1e6))
+assert(stats.calls == 101 and stats.rows == 104)
+assert(stats.p50 <= stats.p99 and stats.p99 <= stats.max)
+closed = fann.create_from_file("myxor.net")
+closed:__gc()
+assert(not pcall(closed.record, closed, "closed.trace"))
+assert(not pcall(fann.replay, closed, "xor.trace"))
+
+-- Run the XOR net through the C functions, with LuaJIT's FFI if available
+runner = require("fann.ffi").runner(ann)
+runner.input[0], runner.input[1] = -1, 1
+print("FFI runner" .. (require("fann.ffi").ffi and "" or " (fallback)") .. ": " .. runner:run()[0])
+assert(math.abs(runner:run()[0] - ann:run(-1, 1)) < 1e-6)
+rows = {{-1, -1}, {-1, 1}, {1, -1}, {1, 1}}
+input = require("fann.ffi").buffer(#rows*2)
+output = require("fann.ffi").buffer(#rows)
+for r, row in ipairs(rows) do
+  input[(r - 1)*2], input[(r - 1)*2 + 1] = row[1], row[2]
+end
+runner:run_batch(#rows, input, output)
+for r, row in ipairs(rows) do
+  assert(math.abs(output[r - 1] - ann:run(row[1], row[2])) < 1e-6)
+end
+net = fann.create_from_file("myxor.net")
+runner = require("fann.ffi").runner(net)
+net:__gc()
+assert(not pcall(runner.run, runner))
+
+-- Parse a training file with several threads instead of FANN's reader
+data = fann.read_train_from_file("xor.data", {threads = 2})
+print("Parallel read: " .. tostring(data))
+
+-- Both readers must give the same values, down to the last bit
+fann.read_train_from_file("decimals.data"):save("decimals_fann.data")
+fann.read_train_from_file("decimals.data", {threads = 3}):save("decimals_parallel.data")
+f = assert(io.open("decimals_fann.data", "rb"))
+saved = f:read("*a")
+f:close()
+f = assert(io.open("decimals_parallel.data", "rb"))
+assert(f:read("*a") == saved)
+f:close()